@@ -1,6 +1,20 @@
 #include <iostream>
 #include <cmath>
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cstring>
+#include <array>
+#include <limits>
+#include <type_traits>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -10,6 +24,480 @@
 
 using namespace std;
 
+
+// Packed bitstream writer
+// bits are accumulated msb first in a 64 bit buffer
+// and flushed to the output 32 bits at a time
+class BitWriter
+{
+private:
+    vector<unsigned char> &out;
+    uint64_t acc;
+    int count;
+    long long total;
+
+public:
+    BitWriter(vector<unsigned char> &out);
+    void write(uint64_t bits, int len);
+    void flush();
+    long long bitsWritten();
+};
+
+BitWriter::BitWriter(vector<unsigned char> &out) : out(out)
+{
+    this->acc = 0;
+    this->count = 0;
+    this->total = 0;
+}
+
+// appends the low len bits of bits (len <= 64)
+void BitWriter::write(uint64_t bits, int len)
+{
+    if (len > 32)
+    {
+        this->write(bits >> 32, len - 32);
+        len = 32;
+    }
+    this->acc = (this->acc << len) | (bits & ((1ull << len) - 1));
+    this->count += len;
+    this->total += len;
+    if (this->count >= 32)
+    {
+        this->count -= 32;
+        uint32_t word = (uint32_t)(this->acc >> this->count);
+        unsigned char b[4] = {(unsigned char)(word >> 24), (unsigned char)(word >> 16),
+                              (unsigned char)(word >> 8), (unsigned char)word};
+        this->out.insert(this->out.end(), b, b + 4);
+    }
+}
+
+// writes out the pending bits, the last byte is padded with zeros
+void BitWriter::flush()
+{
+    while (this->count >= 8)
+    {
+        this->count -= 8;
+        this->out.push_back((unsigned char)(this->acc >> this->count));
+    }
+    if (this->count > 0)
+    {
+        this->out.push_back((unsigned char)(this->acc << (8 - this->count)));
+        this->count = 0;
+    }
+}
+
+long long BitWriter::bitsWritten()
+{
+    return this->total;
+}
+
+
+// Packed bitstream reader
+// keeps up to 64 bits left aligned in buf and refills
+// a whole word at a time while 8 bytes of input remain
+// reading past the end yields zero bits
+class BitReader
+{
+private:
+    const unsigned char *data;
+    long long size;
+    long long pos;
+    uint64_t buf;
+    int avail;
+
+public:
+    BitReader(const unsigned char *data, long long size);
+    void refill();
+    uint32_t peek(int len);
+    void consume(int len);
+    uint32_t read(int len);
+    int readBit();
+    long long position();
+};
+
+BitReader::BitReader(const unsigned char *data, long long size)
+{
+    this->data = data;
+    this->size = size;
+    this->pos = 0;
+    this->buf = 0;
+    this->avail = 0;
+}
+
+// tops buf up to at least 56 valid bits
+void BitReader::refill()
+{
+    if (this->pos + 8 <= this->size)
+    {
+        const unsigned char *p = this->data + this->pos;
+        uint64_t w = ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) |
+                     ((uint64_t)p[3] << 32) | ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+                     ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+        // bytes that only partly fit are ORed in again
+        // on the next refill at the same position
+        this->buf |= w >> this->avail;
+        int take = (63 - this->avail) >> 3;
+        this->pos += take;
+        this->avail += take * 8;
+        return;
+    }
+    while (this->avail <= 56)
+    {
+        uint64_t b = this->pos < this->size ? this->data[this->pos] : 0;
+        this->buf |= b << (56 - this->avail);
+        this->pos++;
+        this->avail += 8;
+    }
+}
+
+// returns the next len bits (1..32) without consuming them
+// caller has to make sure they were refilled
+uint32_t BitReader::peek(int len)
+{
+    return (uint32_t)(this->buf >> (64 - len));
+}
+
+void BitReader::consume(int len)
+{
+    this->buf <<= len;
+    this->avail -= len;
+}
+
+uint32_t BitReader::read(int len)
+{
+    if (this->avail < len)
+        this->refill();
+    uint32_t v = this->peek(len);
+    this->consume(len);
+    return v;
+}
+
+int BitReader::readBit()
+{
+    return (int)this->read(1);
+}
+
+// number of bits consumed so far
+long long BitReader::position()
+{
+    return this->pos * 8 - this->avail;
+}
+
+
+// Packed output of the encoders
+// bytes holds the bitstream msb first, bitCount
+// is the number of valid bits (the rest of the last byte is padding)
+struct EncodedBits
+{
+    vector<unsigned char> bytes;
+    long long bitCount = 0;
+};
+
+
+// Worker pool
+// threads are started once and then handed jobs made of
+// numbered tasks, the calling thread works on the tasks too
+// run() returns when every task of the job is done
+class WorkerPool
+{
+private:
+    vector<thread> workers;
+    mutex m;
+    mutex runLock;
+    condition_variable wake;
+    condition_variable done;
+    function<void(int)> job;
+    atomic<int> nextTask;
+    int taskCount;
+    int finished;
+    int active;
+    long long generation;
+    bool stopping;
+    static thread_local bool insideJob;
+    static thread_local int workerIndex;
+    void workerLoop(int index);
+    void drain();
+
+public:
+    WorkerPool(int threads = 0);
+    ~WorkerPool();
+    int size();
+    void run(int tasks, function<void(int)> fn);
+    static int currentWorker();
+};
+
+thread_local bool WorkerPool::insideJob = false;
+thread_local int WorkerPool::workerIndex = 0;
+
+// threads = 0 uses one thread per core
+WorkerPool::WorkerPool(int threads)
+{
+    if (threads <= 0)
+        threads = max(1, (int)thread::hardware_concurrency());
+    this->nextTask = 0;
+    this->taskCount = 0;
+    this->finished = 0;
+    this->active = 0;
+    this->generation = 0;
+    this->stopping = false;
+    // the caller is the first worker
+    for (int i = 1; i < threads; i++)
+        this->workers.emplace_back(&WorkerPool::workerLoop, this, i);
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        lock_guard<mutex> lk(this->m);
+        this->stopping = true;
+    }
+    this->wake.notify_all();
+    for (thread &t : this->workers)
+        t.join();
+}
+
+int WorkerPool::size()
+{
+    return (int)this->workers.size() + 1;
+}
+
+void WorkerPool::drain()
+{
+    int t;
+    while ((t = this->nextTask++) < this->taskCount)
+    {
+        this->job(t);
+        lock_guard<mutex> lk(this->m);
+        this->finished++;
+    }
+}
+
+void WorkerPool::workerLoop(int index)
+{
+    insideJob = true;
+    workerIndex = index;
+    long long seen = 0;
+    while (true)
+    {
+        {
+            unique_lock<mutex> lk(this->m);
+            this->wake.wait(lk, [&] { return this->stopping || this->generation != seen; });
+            if (this->stopping)
+                return;
+            seen = this->generation;
+            this->active++;
+        }
+        this->drain();
+        {
+            lock_guard<mutex> lk(this->m);
+            this->active--;
+        }
+        this->done.notify_all();
+    }
+}
+
+void WorkerPool::run(int tasks, function<void(int)> fn)
+{
+    if (tasks <= 0)
+        return;
+    // a task that starts a job of its own runs it inline,
+    // waiting for the pool from inside the pool would deadlock
+    if (insideJob)
+    {
+        for (int t = 0; t < tasks; t++)
+            fn(t);
+        return;
+    }
+    lock_guard<mutex> serial(this->runLock);
+    {
+        // a worker that woke up late for the previous job
+        // has to leave drain() before its state is reset
+        unique_lock<mutex> lk(this->m);
+        this->done.wait(lk, [&] { return this->active == 0; });
+        this->job = fn;
+        this->taskCount = tasks;
+        this->nextTask = 0;
+        this->finished = 0;
+        this->generation++;
+    }
+    this->wake.notify_all();
+    insideJob = true;
+    this->drain();
+    insideJob = false;
+    unique_lock<mutex> lk(this->m);
+    this->done.wait(lk, [&] { return this->finished == this->taskCount && this->active == 0; });
+}
+
+// index (0 .. size() - 1) of the worker running the current task,
+// for tasks that pick per worker scratch space
+int WorkerPool::currentWorker()
+{
+    return workerIndex;
+}
+
+WorkerPool &defaultPool()
+{
+    static WorkerPool pool;
+    return pool;
+}
+
+
+// Alphabets
+// text codes bytes, images code the residuals pixel - left + 255
+// which lie in [0, 510]
+const int TEXT_ALPHABET = 256;
+const int IMAGE_ALPHABET = 511;
+
+
+// Histogram kernels
+// counting into a single table stalls whenever the same bin comes up
+// back to back, as each increment has to wait for the previous store,
+// so HIST_WAYS interleaved sub-tables are counted and summed at the end
+// the parallel versions split large inputs into chunks on the pool
+const int HIST_WAYS = 4;
+const long long HIST_PARALLEL_MIN = 1 << 22;
+const long long HIST_CHUNK = 1 << 20;
+
+void histogramBytes(const unsigned char *data, long long n, int freqs[256])
+{
+    uint32_t sub[HIST_WAYS][256];
+    memset(sub, 0, sizeof(sub));
+    long long i = 0;
+    // two rounds over the sub-tables per 8 byte load
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        sub[0][w & 0xff]++;
+        sub[1][(w >> 8) & 0xff]++;
+        sub[2][(w >> 16) & 0xff]++;
+        sub[3][(w >> 24) & 0xff]++;
+        sub[0][(w >> 32) & 0xff]++;
+        sub[1][(w >> 40) & 0xff]++;
+        sub[2][(w >> 48) & 0xff]++;
+        sub[3][w >> 56]++;
+    }
+    for (; i < n; i++)
+        sub[0][data[i]]++;
+    for (int b = 0; b < 256; b++)
+        freqs[b] = (int)(sub[0][b] + sub[1][b] + sub[2][b] + sub[3][b]);
+}
+
+// residual histogram over pixel - left + 255 (see buildHuffmanTreeForImage)
+// prev is the sample before img[0] (0 at the start of an image)
+void histogramResiduals(const unsigned char *img, long long n, int prev, int freqs[511])
+{
+    uint32_t sub[HIST_WAYS][511];
+    memset(sub, 0, sizeof(sub));
+    long long i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        int a = img[i], b = img[i + 1], c = img[i + 2], d = img[i + 3];
+        sub[0][a - prev + 255]++;
+        sub[1][b - a + 255]++;
+        sub[2][c - b + 255]++;
+        sub[3][d - c + 255]++;
+        prev = d;
+    }
+    for (; i < n; i++)
+    {
+        sub[0][img[i] - prev + 255]++;
+        prev = img[i];
+    }
+    for (int v = 0; v < 511; v++)
+        freqs[v] = (int)(sub[0][v] + sub[1][v] + sub[2][v] + sub[3][v]);
+}
+
+// histogram of symbols of any alphabet of Bins symbols
+template <int Bins, typename T>
+void histogramSymbols(const T *data, long long n, int freqs[])
+{
+    uint32_t sub[HIST_WAYS][Bins];
+    memset(sub, 0, sizeof(sub));
+    long long i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        sub[0][data[i]]++;
+        sub[1][data[i + 1]]++;
+        sub[2][data[i + 2]]++;
+        sub[3][data[i + 3]]++;
+    }
+    for (; i < n; i++)
+        sub[0][data[i]]++;
+    for (int b = 0; b < Bins; b++)
+        freqs[b] = (int)(sub[0][b] + sub[1][b] + sub[2][b] + sub[3][b]);
+}
+
+// bytes go through the 8 byte load kernel
+template <>
+void histogramSymbols<TEXT_ALPHABET, unsigned char>(const unsigned char *data, long long n, int freqs[])
+{
+    histogramBytes(data, n, freqs);
+}
+
+// one histogram per channel of interleaved samples,
+// freqs holds channels tables of Bins counts
+template <int Bins, typename T>
+void histogramChannels(const T *data, long long n, int channels, int freqs[])
+{
+    memset(freqs, 0, sizeof(int) * Bins * channels);
+    long long i = 0;
+    for (; i + channels <= n; i += channels)
+    {
+        for (int k = 0; k < channels; k++)
+            freqs[k * Bins + data[i + k]]++;
+    }
+    for (int k = 0; i < n; i++, k++)
+        freqs[k * Bins + data[i]]++;
+}
+
+// sums per chunk tables of size bins counted by count(chunk, first, length)
+void histogramChunks(long long n, int bins, int freqs[], WorkerPool &pool,
+                     function<void(int *, long long, long long)> count)
+{
+    int chunks = (int)((n + HIST_CHUNK - 1) / HIST_CHUNK);
+    vector<int> partial((size_t)chunks * bins);
+    pool.run(chunks, [&](int c) {
+        long long first = c * HIST_CHUNK;
+        count(&partial[(size_t)c * bins], first, min(HIST_CHUNK, n - first));
+    });
+    for (int b = 0; b < bins; b++)
+        freqs[b] = 0;
+    for (int c = 0; c < chunks; c++)
+        for (int b = 0; b < bins; b++)
+            freqs[b] += partial[(size_t)c * bins + b];
+}
+
+template <int Bins, typename T>
+void histogramSymbolsParallel(const T *data, long long n, int freqs[], WorkerPool &pool = defaultPool())
+{
+    if (n < HIST_PARALLEL_MIN || pool.size() == 1)
+    {
+        histogramSymbols<Bins>(data, n, freqs);
+        return;
+    }
+    histogramChunks(n, Bins, freqs, pool, [&](int *out, long long first, long long len) {
+        histogramSymbols<Bins>(data + first, len, out);
+    });
+}
+
+void histogramBytesParallel(const unsigned char *data, long long n, int freqs[256], WorkerPool &pool = defaultPool())
+{
+    histogramSymbolsParallel<TEXT_ALPHABET>(data, n, freqs, pool);
+}
+
+void histogramResidualsParallel(const unsigned char *img, long long n, int freqs[511], WorkerPool &pool = defaultPool())
+{
+    if (n < HIST_PARALLEL_MIN || pool.size() == 1)
+    {
+        histogramResiduals(img, n, 0, freqs);
+        return;
+    }
+    histogramChunks(n, 511, freqs, pool, [&](int *out, long long first, long long len) {
+        histogramResiduals(img + first, len, first == 0 ? 0 : img[first - 1], out);
+    });
+}
+
 // Class for node of the huffman tree
 class HuffNode
 {
@@ -70,8 +558,9 @@ public:
 
 HuffHeap::HuffHeap()
 {
-    this->capacity = 255;
-    this->arr = new HuffNode*[256];
+    // room for all 256 byte values (index 0 is unused)
+    this->capacity = 256;
+    this->arr = new HuffNode*[257];
     this->size = 0;
 }
 
@@ -80,15 +569,14 @@ HuffHeap::HuffHeap(int capacity)
 {
     this->capacity = capacity;
     this->arr = new HuffNode*[this->capacity + 1];
-    this->arr[0] = new HuffNode();
     this->size = 0;
 }
 
 
 HuffHeap::HuffHeap(HuffNode **arr, int s)
 {
-    this->capacity = 255;
-    this->arr = new HuffNode*[256];
+    this->capacity = 256;
+    this->arr = new HuffNode*[257];
     this->arr[0] = new HuffNode();
     this->size = 0;
     for (int i = 0; i < s; i++)
@@ -189,16 +677,23 @@ HuffHeap::~HuffHeap()
 // then we pop first two elements from heap and join them and make a new node
 // continue this step tll only one node remains
 // this will be the huffman tree
-HuffNode *buildHuffmanTree(string s)
+// a maxCodeLen > 0 limits the depth of the tree (see limitTreeDepth)
+HuffNode *limitTreeDepth(HuffNode *root, int n, int maxLen);
+
+// builds the tree over an alphabet of n symbols from their frequencies,
+// shared by the text and the image path
+HuffNode *buildHuffmanTreeFromFreqs(const int freqs[], int n, int maxCodeLen)
 {
-    int charFreqs[256] = {0};
-    for (char c : s)
-        charFreqs[int(c)]++;
-    HuffHeap *h = new HuffHeap();
-    for (int i = 0; i < 256; i++)
+    HuffHeap *h = new HuffHeap(n);
+    for (int i = 0; i < n; i++)
     {
-        if (charFreqs[i] > 0)
-            h->push(new HuffNode(i, charFreqs[i]));
+        if (freqs[i] > 0)
+            h->push(new HuffNode(i, freqs[i]));
+    }
+    if (h->isEmpty())
+    {
+        delete h;
+        return nullptr;
     }
     while (h->getSize() > 1)
     {
@@ -212,236 +707,3726 @@ HuffNode *buildHuffmanTree(string s)
     }
     HuffNode* root = h->pop();
     delete h;
-    return root;
+    return limitTreeDepth(root, n, maxCodeLen);
+}
+
+HuffNode *buildHuffmanTree(const unsigned char *data, long long n, int maxCodeLen = 0)
+{
+    int charFreqs[TEXT_ALPHABET];
+    histogramBytesParallel(data, n, charFreqs);
+    return buildHuffmanTreeFromFreqs(charFreqs, TEXT_ALPHABET, maxCodeLen);
 }
 
-// recursively generate codes by
-// diving into the huffman tree and
-// mapping the codes in an array
-void generateCodes(HuffNode *h, string code, string codes[])
+HuffNode *buildHuffmanTree(string s, int maxCodeLen = 0)
+{
+    return buildHuffmanTree((const unsigned char *)s.data(), (long long)s.length(), maxCodeLen);
+}
+
+// Canonical codes
+// only the code length of every symbol is taken from the tree,
+// the codes themselves are handed out in order of (length, symbol)
+// so a decoder can rebuild them from the lengths alone
+// lengths are capped at MAX_CODE_LEN so codes fit a uint32 and
+// the two level decode table
+const int MAX_CODE_LEN = 24;
+
+struct HuffCode
+{
+    uint32_t code;
+    uint8_t len;
+};
+
+// recursively finds the depth of every leaf
+void computeCodeLengths(HuffNode *h, int depth, int lens[])
 {
     if (!h) return;
     if (!h->left && !h->right)
     {
-        codes[h->symbol] = code;
+        // a tree with a single symbol still needs one bit per symbol
+        lens[h->symbol] = depth == 0 ? 1 : depth;
         return;
     }
-    generateCodes(h->left, code + "0", codes);
-    generateCodes(h->right, code + "1", codes);
+    computeCodeLengths(h->left, depth + 1, lens);
+    computeCodeLengths(h->right, depth + 1, lens);
 }
-string *getHuffmanCodes(HuffNode *h)
+
+// deepest leaf of the tree
+int treeDepth(HuffNode *h)
 {
-    static string codes[256];
-    for (int i = 0; i < 256; i++) codes[i] = "";
-    generateCodes(h, "", codes);
-    return codes;
+    if (!h || (!h->left && !h->right)) return 0;
+    return 1 + max(treeDepth(h->left), treeDepth(h->right));
 }
 
-// draws table of chars, their freq, and their codes 
-void drawTable(string s, string *codes)
+void collectLeafFreqs(HuffNode *h, int freqs[])
 {
-    int charFreqs[256] = {0};
-    for (char c : s)
-        charFreqs[int(c)]++;
-    cout << "char | freq | code" << endl;
-    for (int i = 0; i < 256; i++)
+    if (!h) return;
+    if (!h->left && !h->right)
     {
-        if (charFreqs[i] > 0)
-            cout << "  " << char(i) << "  |   " << charFreqs[i] << "  | " << codes[i] << endl;
+        freqs[h->symbol] = h->f;
+        return;
     }
-    
-}
-
-
-string encode(string s, HuffNode *huffmanTree)
-{
-    string *codes = getHuffmanCodes(huffmanTree);
-    string res = "";
-    for (char c : s)
-        res += codes[int(c)];
-    return res;
+    collectLeafFreqs(h->left, freqs);
+    collectLeafFreqs(h->right, freqs);
 }
 
-string decode(string s, HuffNode *huffmanTree)
+// Length limited code lengths (package-merge)
+// gives the optimal lengths for the frequencies under the
+// constraint that no code is longer than maxLen
+// the leaves (sorted by frequency) are merged maxLen - 1 times
+// with the pairwise packages of the previous list, the first
+// 2k - 2 items of the last list then decide the lengths:
+// every time a leaf shows up in them its code gets one bit longer
+void packageMergeLengths(const int freqs[], int n, int maxLen, uint8_t lens[])
 {
-    string res = "";
-    HuffNode *ptr = huffmanTree;
-    for (char c : s)
-    {   
-        if (c == '0')
-            ptr = ptr->left;
-        else
-            ptr = ptr->right;
+    vector<int> leaves;
+    for (int i = 0; i < n; i++)
+    {
+        lens[i] = 0;
+        if (freqs[i] > 0)
+            leaves.push_back(i);
+    }
+    int k = (int)leaves.size();
+    if (k == 0)
+        return;
+    if (k == 1)
+    {
+        lens[leaves[0]] = 1;
+        return;
+    }
+    // k symbols can not be coded in fewer than ceil(log2(k)) bits
+    while ((1 << maxLen) < k)
+        maxLen++;
+    stable_sort(leaves.begin(), leaves.end(), [&](int a, int b) { return freqs[a] < freqs[b]; });
 
-        if (!ptr->left && !ptr->right)
+    // every list item is either a leaf (its symbol) or a package (-1)
+    vector<vector<uint64_t>> weights(maxLen);
+    vector<vector<int>> items(maxLen);
+    for (int i = 0; i < k; i++)
+    {
+        weights[0].push_back((uint64_t)freqs[leaves[i]]);
+        items[0].push_back(leaves[i]);
+    }
+    for (int level = 1; level < maxLen; level++)
+    {
+        vector<uint64_t> &prev = weights[level - 1];
+        int packages = (int)prev.size() / 2;
+        int li = 0, pi = 0;
+        while (li < k || pi < packages)
         {
-            res += (char)ptr->symbol;
-            ptr = huffmanTree;
+            uint64_t pw = pi < packages ? prev[2 * pi] + prev[2 * pi + 1] : 0;
+            if (li < k && (pi >= packages || (uint64_t)freqs[leaves[li]] <= pw))
+            {
+                weights[level].push_back((uint64_t)freqs[leaves[li]]);
+                items[level].push_back(leaves[li]);
+                li++;
+            }
+            else
+            {
+                weights[level].push_back(pw);
+                items[level].push_back(-1);
+                pi++;
+            }
         }
     }
-    return res;
-}
-
-// Image compression part
-unsigned char *loadImage(string path, int &width, int &height, int &channels)
-{
-    // Loading the image
-    unsigned char *img_data = stbi_load(path.c_str(), &width, &height, &channels, 0);
 
-    if (!img_data)
+    // the packages taken at one level are always the first ones,
+    // so they cover a prefix of the list below
+    int take = 2 * k - 2;
+    for (int level = maxLen - 1; level >= 0 && take > 0; level--)
     {
-        cout << "Error loading the image" << endl;
-        return nullptr;
+        int packages = 0;
+        for (int i = 0; i < take; i++)
+        {
+            if (items[level][i] >= 0)
+                lens[items[level][i]]++;
+            else
+                packages++;
+        }
+        take = 2 * packages;
     }
-    cout << "Image Loaded" << endl;
-    return img_data;
 }
-HuffNode *buildHuffmanTreeForImage(unsigned char *img_data, long long data_size)
+
+// assigns codes numerically from the lengths (0 = unused symbol)
+// returns false if the lengths do not form a valid prefix code
+bool assignCanonicalCodes(const uint8_t lens[], int n, HuffCode codes[])
 {
-    // Array size is 511 because after processing the
-    // pixel values, the range of them is [0, 510]
-    int freqs[511] = {0};
-    for (long long i = 0; i < data_size; i++)
+    int lenCount[MAX_CODE_LEN + 1] = {0};
+    for (int i = 0; i < n; i++)
     {
-        // Used predictive coding here
-        // As the pixel values are quite close,
-        // We subtract the left val from the current pixel val
-        // this creates a list of repeating vals on which
-        // effective huffman encoding can be applied
-        // To cater for negative vals, we add 255
-
-        int pixel = (int)img_data[i];
-        int processed_val = pixel - (i == 0 ? 0 : (int)img_data[i-1]) + 255;
-        freqs[processed_val]++;
+        if (lens[i] > MAX_CODE_LEN)
+            return false;
+        lenCount[lens[i]]++;
     }
+    lenCount[0] = 0;
 
-    HuffHeap *h = new HuffHeap(511);
-    for (int i = 0; i < 511; i++)
+    uint32_t nextCode[MAX_CODE_LEN + 2];
+    uint64_t code = 0;
+    for (int len = 1; len <= MAX_CODE_LEN; len++)
     {
-        if (freqs[i] > 0)
-            h->push(new HuffNode(i, freqs[i]));
+        code = (code + lenCount[len - 1]) << 1;
+        nextCode[len] = (uint32_t)code;
+        if (code + lenCount[len] > (1ull << len))
+            return false;
     }
-    while (h->getSize() > 1)
+    for (int i = 0; i < n; i++)
     {
-        HuffNode *left = h->pop();
-        HuffNode *right = h->pop();
-        HuffNode *newNode = new HuffNode();
-        newNode->f = left->f + right->f;
-        newNode->left = left;
-        newNode->right = right;
-        h->push(newNode);
+        codes[i].len = lens[i];
+        codes[i].code = lens[i] ? nextCode[lens[i]]++ : 0;
     }
-    HuffNode* root = h->pop();
-    delete h;
-    return root;
+    return true;
 }
 
-string *getHuffmanCodesForImage(HuffNode *h)
+// code lengths of a tree over an alphabet of n symbols
+// trees deeper than maxLen get optimal limited lengths instead
+void getCodeLengths(HuffNode *h, int n, uint8_t lens[], int maxLen = MAX_CODE_LEN)
 {
-    static string codes[511];
-    for (int i = 0; i < 511; i++) codes[i] = "";
-    generateCodes(h, "", codes);
-    return codes;
-}
-
-string encodeImage(string path)
-{
-    // Loading the image
-    int width, height, channels;
-    unsigned char *img_data = loadImage(path, width, height, channels);
-    long long data_size = width * height * channels;
-    if (!img_data)
-        return "";
-    string res = "";
-    HuffNode *huffmanTree = buildHuffmanTreeForImage(img_data, data_size);
-    string *codes = getHuffmanCodesForImage(huffmanTree);
-    for (long long i = 0; i < data_size; i++)
+    if (treeDepth(h) > maxLen)
     {
-        int pixel = (int)img_data[i];
-        int processed_val = pixel - (i == 0 ? 0 : (int)img_data[i-1]) + 255;
-        res += codes[processed_val];
+        vector<int> freqs(n, 0);
+        collectLeafFreqs(h, freqs.data());
+        packageMergeLengths(freqs.data(), n, maxLen, lens);
+        return;
     }
+    vector<int> depth(n, 0);
+    computeCodeLengths(h, 0, depth.data());
+    for (int i = 0; i < n; i++)
+        lens[i] = (uint8_t)depth[i];
+}
 
-    return res;
+void getCanonicalCodes(HuffNode *h, int n, HuffCode codes[])
+{
+    vector<uint8_t> lens(n);
+    getCodeLengths(h, n, lens.data());
+    assignCanonicalCodes(lens.data(), n, codes);
 }
 
+string codeToString(HuffCode c)
+{
+    string res = "";
+    for (int b = c.len - 1; b >= 0; b--)
+        res += ((c.code >> b) & 1) ? '1' : '0';
+    return res;
+}
 
-// Saving the image after decoding
-void saveImage(string path, unsigned char *img_data, int width, int height, int channels)
+// the codes of an alphabet of AlphabetSize symbols as strings
+template <int AlphabetSize>
+void codeStrings(HuffNode *h, string codes[])
 {
-    stbi_write_png(path.c_str(), width, height, channels, img_data, width*channels);
-    cout << "Decoded image saved" << endl;
-    delete[] img_data;
+    HuffCode canonical[AlphabetSize];
+    getCanonicalCodes(h, AlphabetSize, canonical);
+    for (int i = 0; i < AlphabetSize; i++) codes[i] = codeToString(canonical[i]);
 }
 
-unsigned char *decodeImage(string encodeImage, HuffNode *huffmanTree, long long data_size)
+// draws table of chars, their freq, and their codes 
+void drawTable(string s, string *codes)
 {
-    unsigned char *img_data = new unsigned char [data_size];
-    long long i = 0;
+    int charFreqs[256];
+    histogramBytesParallel((const unsigned char *)s.data(), (long long)s.length(), charFreqs);
+    cout << "char | freq | code" << endl;
+    for (int i = 0; i < 256; i++)
+    {
+        if (charFreqs[i] > 0)
+            cout << "  " << char(i) << "  |   " << charFreqs[i] << "  | " << codes[i] << endl;
+    }
+    
+}
 
-    HuffNode *ptr = huffmanTree;
-    for (char bit : encodeImage)
+// rebuilds a tree that matches the canonical codes,
+// used when decoding by walking the tree
+// leaves get their frequency back when freqs is given
+HuffNode *buildCanonicalTree(const HuffCode codes[], int n, const int freqs[] = nullptr)
+{
+    HuffNode *root = new HuffNode();
+    for (int i = 0; i < n; i++)
     {
-        if (bit == '0')
-            ptr = ptr->left;
-        else
-            ptr = ptr->right;
-        
-        if (!ptr->left && !ptr->right)
+        HuffNode *ptr = root;
+        for (int b = codes[i].len - 1; b >= 0; b--)
+        {
+            HuffNode *&next = ((codes[i].code >> b) & 1) ? ptr->right : ptr->left;
+            if (!next)
+                next = new HuffNode();
+            ptr = next;
+        }
+        if (codes[i].len)
+        {
+            ptr->symbol = i;
+            ptr->f = freqs ? freqs[i] : 0;
+        }
+    }
+    return root;
+}
+
+// replaces a tree deeper than maxLen by the canonical tree
+// of its optimal length limited code (maxLen <= 0 keeps any depth)
+HuffNode *limitTreeDepth(HuffNode *root, int n, int maxLen)
+{
+    if (!root || maxLen <= 0 || treeDepth(root) <= maxLen)
+        return root;
+    vector<int> freqs(n, 0);
+    collectLeafFreqs(root, freqs.data());
+    vector<uint8_t> lens(n);
+    packageMergeLengths(freqs.data(), n, maxLen, lens.data());
+    vector<HuffCode> codes(n);
+    assignCanonicalCodes(lens.data(), n, codes.data());
+    HuffNode *limited = buildCanonicalTree(codes.data(), n, freqs.data());
+    limited->f = root->f;
+    delete root;
+    return limited;
+}
+
+
+// Flat huffman tree
+// an arena keeps the nodes of several trees in contiguous
+// struct-of-arrays storage with 16 bit child indices, nodes are never
+// freed one by one: reset() drops every tree at once and keeps the
+// storage, so building trees in a loop does not malloc and there is no
+// recursive destructor
+// the arena holds at most FLAT_NONE nodes (about 64 trees of the image
+// alphabet), once it is full newNode returns FLAT_NONE and the builders
+// return empty trees until reset()
+// leaves have no children (FLAT_NONE)
+const uint16_t FLAT_NONE = 0xffff;
+
+class HuffArena
+{
+public:
+    vector<uint16_t> left;
+    vector<uint16_t> right;
+    vector<uint16_t> symbol;
+    vector<uint64_t> freq;
+    int used;
+    HuffArena(int capacity = 2 * IMAGE_ALPHABET);
+    int newNode(int symbol, uint64_t f, int left, int right);
+    int room();
+    void reset();
+};
+
+HuffArena::HuffArena(int capacity)
+{
+    this->left.resize(capacity);
+    this->right.resize(capacity);
+    this->symbol.resize(capacity);
+    this->freq.resize(capacity);
+    this->used = 0;
+}
+
+int HuffArena::newNode(int symbol, uint64_t f, int left, int right)
+{
+    // FLAT_NONE itself is never a node index
+    if (this->used == (int)FLAT_NONE)
+        return FLAT_NONE;
+    if (this->used == (int)this->left.size())
+    {
+        int capacity = min(2 * this->used + 2, (int)FLAT_NONE);
+        this->left.resize(capacity);
+        this->right.resize(capacity);
+        this->symbol.resize(capacity);
+        this->freq.resize(capacity);
+    }
+    int i = this->used++;
+    this->symbol[i] = (uint16_t)symbol;
+    this->freq[i] = f;
+    this->left[i] = (uint16_t)left;
+    this->right[i] = (uint16_t)right;
+    return i;
+}
+
+// how many more nodes fit
+int HuffArena::room()
+{
+    return (int)FLAT_NONE - this->used;
+}
+
+void HuffArena::reset()
+{
+    this->used = 0;
+}
+
+// a tree inside an arena, its nodes are [first, arena->used)
+// at the time it was built, root is -1 for an empty tree
+struct FlatHuffTree
+{
+    HuffArena *arena;
+    int first;
+    int root;
+};
+
+// how the two smallest nodes are found while building a tree
+//   BUILD_HEAP       binary heap like HuffHeap, O(k log k)
+//   BUILD_TWO_QUEUE  leaves sorted once by a radix sort, then merged
+//                    from two queues in O(k)
+enum TreeBuilder
+{
+    BUILD_HEAP,
+    BUILD_TWO_QUEUE
+};
+
+// stable LSD radix sort of the used symbols by frequency, 11 bits
+// per pass and only as many passes as the largest frequency needs
+// returns the number of symbols written to sorted
+int sortLeavesByFreq(const int freqs[], int n, uint16_t sorted[])
+{
+    uint16_t tmp[1024];
+    int k = 0;
+    int maxFreq = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (freqs[i] > 0)
+        {
+            sorted[k++] = (uint16_t)i;
+            maxFreq = max(maxFreq, freqs[i]);
+        }
+    }
+    for (int shift = 0; shift < 32 && (maxFreq >> shift) > 0; shift += 11)
+    {
+        int count[2049] = {0};
+        for (int i = 0; i < k; i++)
+            count[((freqs[sorted[i]] >> shift) & 2047) + 1]++;
+        for (int d = 0; d < 2048; d++)
+            count[d + 1] += count[d];
+        for (int i = 0; i < k; i++)
+            tmp[count[(freqs[sorted[i]] >> shift) & 2047]++] = sorted[i];
+        memcpy(sorted, tmp, k * sizeof(uint16_t));
+    }
+    return k;
+}
+
+// classic two queue merge: leaves come out of the sorted queue and
+// merged nodes are made in order of weight, so they form a second
+// sorted queue and the two smallest nodes are always at the fronts
+FlatHuffTree buildFlatTwoQueue(const int freqs[], int n, HuffArena &arena)
+{
+    FlatHuffTree t = {&arena, arena.used, -1};
+    uint16_t sorted[1024];
+    int k = sortLeavesByFreq(freqs, n, sorted);
+    if (k == 0 || 2 * k - 1 > arena.room())
+        return t;
+    for (int i = 0; i < k; i++)
+        arena.newNode(sorted[i], (uint64_t)freqs[sorted[i]], FLAT_NONE, FLAT_NONE);
+
+    // leaves are [t.first, t.first + k), merged nodes follow them
+    int leaf = t.first, leafEnd = t.first + k;
+    int merged = leafEnd;
+    auto takeSmallest = [&]() {
+        if (leaf < leafEnd && (merged >= arena.used || arena.freq[leaf] <= arena.freq[merged]))
+            return leaf++;
+        return merged++;
+    };
+    for (int i = 0; i < k - 1; i++)
+    {
+        int a = takeSmallest();
+        int b = takeSmallest();
+        arena.newNode(0, arena.freq[a] + arena.freq[b], a, b);
+    }
+    t.root = arena.used - 1;
+    return t;
+}
+
+// same greedy merge as buildHuffmanTree, the heap holds node indices
+// in a fixed array so nothing but the arena is touched
+FlatHuffTree buildFlatHuffmanTree(const int freqs[], int n, HuffArena &arena,
+                                  TreeBuilder builder = BUILD_TWO_QUEUE)
+{
+    if (builder == BUILD_TWO_QUEUE)
+        return buildFlatTwoQueue(freqs, n, arena);
+    FlatHuffTree t = {&arena, arena.used, -1};
+    int k = 0;
+    for (int i = 0; i < n; i++)
+        k += freqs[i] > 0;
+    if (k == 0 || 2 * k - 1 > arena.room())
+        return t;
+    uint16_t heap[1024];
+    int size = 0;
+    // ties go to the older node so trees come out the same every time
+    auto later = [&](uint16_t a, uint16_t b) {
+        return arena.freq[a] != arena.freq[b] ? arena.freq[a] > arena.freq[b] : a > b;
+    };
+    for (int i = 0; i < n; i++)
+    {
+        if (freqs[i] <= 0)
+            continue;
+        heap[size++] = (uint16_t)arena.newNode(i, (uint64_t)freqs[i], FLAT_NONE, FLAT_NONE);
+        push_heap(heap, heap + size, later);
+    }
+    while (size > 1)
+    {
+        pop_heap(heap, heap + size--, later);
+        uint16_t a = heap[size];
+        pop_heap(heap, heap + size--, later);
+        uint16_t b = heap[size];
+        heap[size++] = (uint16_t)arena.newNode(0, arena.freq[a] + arena.freq[b], a, b);
+        push_heap(heap, heap + size, later);
+    }
+    t.root = heap[0];
+    return t;
+}
+
+// children are always created before their parent, so one pass
+// from the root down over the node indices gives every depth
+void flatCodeLengths(const FlatHuffTree &t, int n, uint8_t lens[], int maxLen = MAX_CODE_LEN)
+{
+    for (int i = 0; i < n; i++)
+        lens[i] = 0;
+    if (t.root < 0)
+        return;
+    HuffArena &a = *t.arena;
+    uint16_t depth[1024];
+    depth[t.root - t.first] = 0;
+    int maxDepth = 0;
+    for (int i = t.root; i >= t.first; i--)
+    {
+        int d = depth[i - t.first];
+        if (a.left[i] == FLAT_NONE)
+        {
+            // a tree with a single symbol still needs one bit per symbol
+            lens[a.symbol[i]] = (uint8_t)min(max(d, 1), 255);
+            maxDepth = max(maxDepth, d);
+            continue;
+        }
+        depth[a.left[i] - t.first] = (uint16_t)(d + 1);
+        depth[a.right[i] - t.first] = (uint16_t)(d + 1);
+    }
+    if (maxDepth <= maxLen)
+        return;
+    vector<int> freqs(n, 0);
+    for (int i = t.first; i <= t.root; i++)
+    {
+        if (a.left[i] == FLAT_NONE)
+            freqs[a.symbol[i]] = (int)a.freq[i];
+    }
+    packageMergeLengths(freqs.data(), n, maxLen, lens);
+}
+
+// flat version of buildCanonicalTree for decoding by walking the tree,
+// here parents come first and a node is a leaf when it has no children
+FlatHuffTree buildCanonicalFlatTree(const HuffCode codes[], int n, HuffArena &arena)
+{
+    FlatHuffTree t = {&arena, arena.used, -1};
+    int root = arena.newNode(0, 0, FLAT_NONE, FLAT_NONE);
+    if (root == FLAT_NONE)
+        return t;
+    t.root = root;
+    for (int i = 0; i < n; i++)
+    {
+        int node = t.root;
+        for (int b = codes[i].len - 1; b >= 0; b--)
         {
-            // Here we apply the reverse process of before
-            // first 255 is subtracted
-            // then the left val is added
-            int val = ptr->symbol - 255 + (i == 0 ? 0 : img_data[i-1]);
+            bool one = (codes[i].code >> b) & 1;
+            int next = one ? arena.right[node] : arena.left[node];
+            if (next == FLAT_NONE)
+            {
+                next = arena.newNode(0, 0, FLAT_NONE, FLAT_NONE);
+                if (next == FLAT_NONE)
+                {
+                    t.root = -1;
+                    return t;
+                }
+                if (one)
+                    arena.right[node] = (uint16_t)next;
+                else
+                    arena.left[node] = (uint16_t)next;
+            }
+            node = next;
+        }
+        if (codes[i].len)
+            arena.symbol[node] = (uint16_t)i;
+    }
+    return t;
+}
+
+
+// Lookup table decoder
+// the next DECODE_TABLE_BITS bits of the stream index the primary table,
+// each entry gives the symbol and its code length in one load
+// codes longer than that continue in a second level table
+// entry layout: bits 0-5 length, bit 7 sub table flag, bits 8-31 symbol
+// for sub table entries the length field holds the sub table bits
+// and the symbol field the offset of the sub table
+const int DECODE_TABLE_BITS = 11;
+const int DECODE_SUB_MAX_BITS = MAX_CODE_LEN - DECODE_TABLE_BITS;
+const uint32_t DECODE_SUB_FLAG = 0x80;
+
+enum DecodeStrategy
+{
+    DECODE_TREE_WALK,
+    DECODE_TABLE
+};
+
+class DecodeTable
+{
+public:
+    vector<uint32_t> entries;
+    DecodeTable();
+    bool build(const HuffCode codes[], int n);
+    int decodeSymbol(BitReader &r);
+};
+
+DecodeTable::DecodeTable()
+{
+    this->entries.assign(1 << DECODE_TABLE_BITS, 0);
+}
+
+// fills the table from per symbol codes (len 0 = unused symbol)
+// returns false when a code is too long for the two levels
+bool DecodeTable::build(const HuffCode codes[], int n)
+{
+    const int primary = 1 << DECODE_TABLE_BITS;
+    // unused slots only come up on corrupt input, they decode as symbol 0
+    this->entries.assign(primary, 1);
+
+    // sub table size for every primary slot is set by its longest code
+    int subBits[1 << DECODE_TABLE_BITS] = {0};
+    for (int i = 0; i < n; i++)
+    {
+        int len = codes[i].len;
+        if (len <= DECODE_TABLE_BITS)
+            continue;
+        if (len > DECODE_TABLE_BITS + DECODE_SUB_MAX_BITS)
+            return false;
+        int prefix = (int)(codes[i].code >> (len - DECODE_TABLE_BITS));
+        subBits[prefix] = max(subBits[prefix], len - DECODE_TABLE_BITS);
+    }
+    for (int p = 0; p < primary; p++)
+    {
+        if (subBits[p] == 0)
+            continue;
+        uint32_t offset = (uint32_t)this->entries.size();
+        this->entries[p] = (offset << 8) | DECODE_SUB_FLAG | (uint32_t)subBits[p];
+        this->entries.resize(offset + (1 << subBits[p]), 1);
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        int len = codes[i].len;
+        if (len == 0)
+            continue;
+        if (len <= DECODE_TABLE_BITS)
+        {
+            uint32_t first = codes[i].code << (DECODE_TABLE_BITS - len);
+            uint32_t count = 1u << (DECODE_TABLE_BITS - len);
+            for (uint32_t k = 0; k < count; k++)
+                this->entries[first + k] = ((uint32_t)i << 8) | (uint32_t)len;
+            continue;
+        }
+        int rest = len - DECODE_TABLE_BITS;
+        int prefix = (int)(codes[i].code >> rest);
+        uint32_t offset = this->entries[prefix] >> 8;
+        int bits = subBits[prefix];
+        uint32_t low = codes[i].code & ((1u << rest) - 1);
+        uint32_t first = offset + (low << (bits - rest));
+        uint32_t count = 1u << (bits - rest);
+        for (uint32_t k = 0; k < count; k++)
+            this->entries[first + k] = ((uint32_t)i << 8) | (uint32_t)rest;
+    }
+    return true;
+}
+
+// decodes one symbol, the reader must hold at least
+// MAX_CODE_LEN bits (one refill)
+inline int DecodeTable::decodeSymbol(BitReader &r)
+{
+    uint32_t e = this->entries[r.peek(DECODE_TABLE_BITS)];
+    if (e & DECODE_SUB_FLAG)
+    {
+        r.consume(DECODE_TABLE_BITS);
+        e = this->entries[(e >> 8) + r.peek(e & 0x3f)];
+    }
+    r.consume(e & 0x3f);
+    return (int)(e >> 8);
+}
+
+// shows a packed bitstream as 0s and 1s
+string toBitString(const EncodedBits &bits)
+{
+    string res = "";
+    res.reserve(bits.bitCount);
+    for (long long i = 0; i < bits.bitCount; i++)
+        res += ((bits.bytes[i >> 3] >> (7 - (i & 7))) & 1) ? '1' : '0';
+    return res;
+}
+
+
+// rANS
+// range variant of asymmetric numeral systems: the counted frequencies
+// are scaled to sum to RANS_SCALE and every symbol moves a 64 bit state
+// by log2(RANS_SCALE / freq) bits, so skewed distributions cost less
+// than a whole bit per symbol; symbol i goes to state i % 4 like the
+// four Huffman streams, the encoder works backwards and the decoder
+// reads forwards, a state takes in 32 bits at a time when it drops
+// below RANS_LOW
+// a rANS segment holds the scaled frequencies (see writeFreqs), then the
+// four final states (u64 big endian, state 0 first) and the 32 bit words
+// (big endian) the states were renormalised with
+const int RANS_SCALE_BITS = 12;
+const uint32_t RANS_SCALE = 1u << RANS_SCALE_BITS;
+const uint64_t RANS_LOW = 1ull << 31;
+
+inline int bitLength(uint32_t v)
+{
+    int k = 0;
+    while (v >> k)
+        k++;
+    return k;
+}
+
+inline uint32_t ransWord(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+inline uint64_t ransState(const unsigned char *p)
+{
+    return (uint64_t)ransWord(p) << 32 | ransWord(p + 4);
+}
+
+// what the decoder needs of the symbol a state slot falls in: its
+// frequency, the slot's distance from its start and the symbol
+template <typename SymbolT>
+struct RansSlot
+{
+    uint16_t freq;
+    uint16_t offset;
+    SymbolT symbol;
+};
+
+template <int AlphabetSize, typename SymbolT>
+class RansTable
+{
+public:
+    array<uint32_t, AlphabetSize> freqs;
+    array<uint32_t, AlphabetSize> starts;
+    array<RansSlot<SymbolT>, RANS_SCALE> slots;
+    void scale(const int counts[]);
+    double costBits(const int counts[]);
+    void writeFreqs(vector<unsigned char> &out);
+    bool parseFreqs(const unsigned char *p, long long size, long long &pos);
+    void encode(const SymbolT *data, long long n, vector<unsigned char> &scratch, vector<unsigned char> &out);
+    void decode(const unsigned char *bytes, long long size, SymbolT *out, long long n);
+};
+
+// every counted symbol keeps at least 1 of RANS_SCALE, the rounding
+// error is taken from (or given to) the most frequent symbols
+template <int AlphabetSize, typename SymbolT>
+void RansTable<AlphabetSize, SymbolT>::scale(const int counts[])
+{
+    long long total = 0;
+    int top = 0;
+    for (int i = 0; i < AlphabetSize; i++)
+    {
+        total += counts[i];
+        if (counts[i] > counts[top])
+            top = i;
+    }
+    long long sum = 0;
+    for (int i = 0; i < AlphabetSize; i++)
+    {
+        this->freqs[i] = counts[i] == 0 ? 0 : max(1u, (uint32_t)(counts[i] * (long long)RANS_SCALE / max(total, 1ll)));
+        sum += this->freqs[i];
+    }
+    if (sum < RANS_SCALE)
+        this->freqs[top] += (uint32_t)(RANS_SCALE - sum);
+    if (sum > RANS_SCALE)
+    {
+        uint32_t cut = min((uint32_t)(sum - RANS_SCALE), this->freqs[top] / 2);
+        this->freqs[top] -= cut;
+        sum -= cut;
+    }
+    while (sum > RANS_SCALE)
+        for (int i = 0; i < AlphabetSize && sum > RANS_SCALE; i++)
+            if (this->freqs[i] > 1)
+            {
+                this->freqs[i]--;
+                sum--;
+            }
+    uint32_t start = 0;
+    for (int i = 0; i < AlphabetSize; i++)
+    {
+        this->starts[i] = start;
+        start += this->freqs[i];
+    }
+}
+
+// payload bits of coding counts with the scaled frequencies
+template <int AlphabetSize, typename SymbolT>
+double RansTable<AlphabetSize, SymbolT>::costBits(const int counts[])
+{
+    double bits = 0;
+    for (int i = 0; i < AlphabetSize; i++)
+        if (counts[i] > 0)
+            bits += counts[i] * (RANS_SCALE_BITS - log2((double)this->freqs[i]));
+    return bits;
+}
 
-            img_data[i] = (unsigned char)val;
+// the bit length of each frequency in 4 bits and the bits below its top
+// bit, a zero frequency is followed by 8 bits holding how many more
+// zeros come after it (like the code lengths)
+template <int AlphabetSize, typename SymbolT>
+void RansTable<AlphabetSize, SymbolT>::writeFreqs(vector<unsigned char> &out)
+{
+    size_t sizePos = out.size();
+    out.resize(sizePos + 2);
+    BitWriter w(out);
+    for (int i = 0; i < AlphabetSize; i++)
+    {
+        int k = bitLength(this->freqs[i]);
+        w.write(k, 4);
+        if (k > 1)
+            w.write(this->freqs[i], k - 1);
+        if (k != 0)
+            continue;
+        int run = 0;
+        while (i + 1 < AlphabetSize && this->freqs[i + 1] == 0 && run < 255)
+        {
+            run++;
             i++;
+        }
+        w.write(run, 8);
+    }
+    w.flush();
+    size_t size = out.size() - sizePos - 2;
+    out[sizePos] = (unsigned char)size;
+    out[sizePos + 1] = (unsigned char)(size >> 8);
+}
+
+// reads the frequencies and builds the decode tables, false unless
+// they sum to RANS_SCALE
+template <int AlphabetSize, typename SymbolT>
+bool RansTable<AlphabetSize, SymbolT>::parseFreqs(const unsigned char *p, long long size, long long &pos)
+{
+    if (pos + 2 > size)
+        return false;
+    long long len = p[pos] | (p[pos + 1] << 8);
+    pos += 2;
+    if (pos + len > size)
+        return false;
+    BitReader r(p + pos, len);
+    pos += len;
+    uint32_t start = 0;
+    for (int i = 0; i < AlphabetSize; i++)
+    {
+        if (r.position() >= len * 8)
+            return false;
+        int k = (int)r.read(4);
+        if (k > RANS_SCALE_BITS + 1)
+            return false;
+        this->freqs[i] = k == 0 ? 0 : (1u << (k - 1)) | (k > 1 ? r.read(k - 1) : 0);
+        this->starts[i] = start;
+        if (this->freqs[i] > RANS_SCALE - start)
+            return false;
+        for (uint32_t j = 0; j < this->freqs[i]; j++)
+        {
+            RansSlot<SymbolT> slot = {(uint16_t)this->freqs[i], (uint16_t)j, (SymbolT)i};
+            this->slots[start + j] = slot;
+        }
+        start += this->freqs[i];
+        if (k != 0)
+            continue;
+        int run = (int)r.read(8);
+        if (i + run >= AlphabetSize)
+            return false;
+        for (int j = 0; j < run; j++)
+        {
+            this->freqs[++i] = 0;
+            this->starts[i] = start;
+        }
+    }
+    return start == RANS_SCALE;
+}
 
-            ptr = huffmanTree;
+// appends the states and renormalisation words of n symbols to out,
+// scratch collects the bytes backwards
+template <int AlphabetSize, typename SymbolT>
+void RansTable<AlphabetSize, SymbolT>::encode(const SymbolT *data, long long n, vector<unsigned char> &scratch,
+                                              vector<unsigned char> &out)
+{
+    scratch.clear();
+    scratch.reserve(n / 2 + 32);
+    uint64_t x[4] = {RANS_LOW, RANS_LOW, RANS_LOW, RANS_LOW};
+    for (long long i = n - 1; i >= 0; i--)
+    {
+        uint64_t &s = x[i & 3];
+        uint32_t f = this->freqs[data[i]];
+        if (s >= ((RANS_LOW >> RANS_SCALE_BITS) << 32) * f)
+        {
+            for (int b = 0; b < 4; b++)
+                scratch.push_back((unsigned char)(s >> (8 * b)));
+            s >>= 32;
         }
+        s = ((s / f) << RANS_SCALE_BITS) + s % f + this->starts[data[i]];
     }
+    for (int j = 3; j >= 0; j--)
+        for (int b = 0; b < 8; b++)
+            scratch.push_back((unsigned char)(x[j] >> (8 * b)));
+    out.insert(out.end(), scratch.rbegin(), scratch.rend());
+}
 
-    return img_data;
+// words past the end read as zeros, parseSegment has checked that the
+// states start in range so a corrupt stream can not stall them
+template <int AlphabetSize, typename SymbolT>
+void RansTable<AlphabetSize, SymbolT>::decode(const unsigned char *bytes, long long size, SymbolT *out, long long n)
+{
+    const uint32_t mask = RANS_SCALE - 1;
+    const RansSlot<SymbolT> *slots = this->slots.data();
+    uint64_t x0 = ransState(bytes), x1 = ransState(bytes + 8), x2 = ransState(bytes + 16), x3 = ransState(bytes + 24);
+    long long pos = 32;
+    long long i = 0;
+    // a step takes at most one word per state, so 4 steps need no checks
+    // while 16 bytes remain
+    for (; i + 4 <= n && pos + 16 <= size; i += 4)
+    {
+        RansSlot<SymbolT> e0 = slots[x0 & mask], e1 = slots[x1 & mask], e2 = slots[x2 & mask], e3 = slots[x3 & mask];
+        out[i] = e0.symbol;
+        out[i + 1] = e1.symbol;
+        out[i + 2] = e2.symbol;
+        out[i + 3] = e3.symbol;
+        x0 = e0.freq * (x0 >> RANS_SCALE_BITS) + e0.offset;
+        x1 = e1.freq * (x1 >> RANS_SCALE_BITS) + e1.offset;
+        x2 = e2.freq * (x2 >> RANS_SCALE_BITS) + e2.offset;
+        x3 = e3.freq * (x3 >> RANS_SCALE_BITS) + e3.offset;
+        if (x0 < RANS_LOW)
+        {
+            x0 = (x0 << 32) | ransWord(bytes + pos);
+            pos += 4;
+        }
+        if (x1 < RANS_LOW)
+        {
+            x1 = (x1 << 32) | ransWord(bytes + pos);
+            pos += 4;
+        }
+        if (x2 < RANS_LOW)
+        {
+            x2 = (x2 << 32) | ransWord(bytes + pos);
+            pos += 4;
+        }
+        if (x3 < RANS_LOW)
+        {
+            x3 = (x3 << 32) | ransWord(bytes + pos);
+            pos += 4;
+        }
+    }
+    uint64_t x[4] = {x0, x1, x2, x3};
+    for (; i < n; i++)
+    {
+        uint64_t &s = x[i & 3];
+        RansSlot<SymbolT> e = slots[s & mask];
+        out[i] = e.symbol;
+        s = e.freq * (s >> RANS_SCALE_BITS) + e.offset;
+        if (s < RANS_LOW)
+        {
+            s = (s << 32) | (pos + 4 <= size ? ransWord(bytes + pos) : 0);
+            pos += 4;
+        }
+    }
+}
+
+
+// Huffman coder
+// everything between the symbols of one alphabet and the bitstream,
+// for AlphabetSize symbols of type SymbolT; the per symbol tables are
+// sized at compile time so each alphabet gets its own fixed loops
+// text is coded through TextCoder, images through ImageCoder on
+// the residuals, a new alphabet only needs another instantiation
+template <int AlphabetSize, typename SymbolT>
+class HuffmanCoder
+{
+public:
+    typedef SymbolT Symbol;
+    static const int alphabetSize = AlphabetSize;
+    array<int, AlphabetSize> freqs;
+    array<uint8_t, AlphabetSize> lens;
+    array<HuffCode, AlphabetSize> codes;
+    DecodeTable table;
+    RansTable<AlphabetSize, SymbolT> rans;
+    // the longest code buildCodes makes (up to MAX_CODE_LEN), a lower
+    // limit keeps the second level decode tables small; the lengths are
+    // stored, so decoders need not know it
+    int maxLen = MAX_CODE_LEN;
+    void count(const SymbolT *data, long long n);
+    void buildCodes(HuffArena &arena, TreeBuilder builder = BUILD_TWO_QUEUE);
+    bool assignCodes();
+    bool useLengths(const uint8_t codeLens[]);
+    bool buildDecoder();
+    void encode(const SymbolT *data, long long n, EncodedBits &res);
+    void encodeFour(const SymbolT *data, long long n, EncodedBits streams[4]);
+    void decode(const unsigned char *bytes, long long size, SymbolT *out, long long n);
+    void decodeFour(const unsigned char *const data[4], const long long size[4], SymbolT *out, long long n);
+    long long walkTree(const EncodedBits &bits, SymbolT *out, long long maxCount);
+};
+
+typedef HuffmanCoder<TEXT_ALPHABET, unsigned char> TextCoder;
+typedef HuffmanCoder<IMAGE_ALPHABET, uint16_t> ImageCoder;
+
+template <int AlphabetSize, typename SymbolT>
+void HuffmanCoder<AlphabetSize, SymbolT>::count(const SymbolT *data, long long n)
+{
+    histogramSymbols<AlphabetSize>(data, n, this->freqs.data());
+}
+
+// code lengths and canonical codes from the counted frequencies
+template <int AlphabetSize, typename SymbolT>
+void HuffmanCoder<AlphabetSize, SymbolT>::buildCodes(HuffArena &arena, TreeBuilder builder)
+{
+    arena.reset();
+    FlatHuffTree t = buildFlatHuffmanTree(this->freqs.data(), AlphabetSize, arena, builder);
+    flatCodeLengths(t, AlphabetSize, this->lens.data(), min(this->maxLen, MAX_CODE_LEN));
+    assignCanonicalCodes(this->lens.data(), AlphabetSize, this->codes.data());
+}
+
+// canonical codes for the code lengths in lens
+template <int AlphabetSize, typename SymbolT>
+bool HuffmanCoder<AlphabetSize, SymbolT>::assignCodes()
+{
+    return assignCanonicalCodes(this->lens.data(), AlphabetSize, this->codes.data());
 }
 
+// takes code lengths from elsewhere (a tree or a container)
+template <int AlphabetSize, typename SymbolT>
+bool HuffmanCoder<AlphabetSize, SymbolT>::useLengths(const uint8_t codeLens[])
+{
+    copy(codeLens, codeLens + AlphabetSize, this->lens.begin());
+    return this->assignCodes();
+}
 
+template <int AlphabetSize, typename SymbolT>
+bool HuffmanCoder<AlphabetSize, SymbolT>::buildDecoder()
+{
+    return this->table.build(this->codes.data(), AlphabetSize);
+}
 
+// encodes n symbols into res, whose buffer is reused
+template <int AlphabetSize, typename SymbolT>
+void HuffmanCoder<AlphabetSize, SymbolT>::encode(const SymbolT *data, long long n, EncodedBits &res)
+{
+    const HuffCode *codes = this->codes.data();
+    res.bytes.clear();
+    res.bytes.reserve(n / 2 + 8);
+    BitWriter w(res.bytes);
+    for (long long i = 0; i < n; i++)
+        w.write(codes[data[i]].code, codes[data[i]].len);
+    w.flush();
+    res.bitCount = w.bitsWritten();
+}
 
+// Four way interleaved streams
+// symbol i goes to stream i % 4, so the decoder can work on four
+// independent bit readers at once instead of one serial chain
+// where every code length decides where the next code starts
+template <int AlphabetSize, typename SymbolT>
+void HuffmanCoder<AlphabetSize, SymbolT>::encodeFour(const SymbolT *data, long long n, EncodedBits streams[4])
+{
+    const HuffCode *codes = this->codes.data();
+    for (int j = 0; j < 4; j++)
+    {
+        streams[j].bytes.clear();
+        streams[j].bytes.reserve(n / 8 + 8);
+    }
+    BitWriter w0(streams[0].bytes), w1(streams[1].bytes), w2(streams[2].bytes), w3(streams[3].bytes);
+    long long i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        w0.write(codes[data[i]].code, codes[data[i]].len);
+        w1.write(codes[data[i + 1]].code, codes[data[i + 1]].len);
+        w2.write(codes[data[i + 2]].code, codes[data[i + 2]].len);
+        w3.write(codes[data[i + 3]].code, codes[data[i + 3]].len);
+    }
+    BitWriter *w[4] = {&w0, &w1, &w2, &w3};
+    for (; i < n; i++)
+        w[i & 3]->write(codes[data[i]].code, codes[data[i]].len);
+    for (int j = 0; j < 4; j++)
+    {
+        w[j]->flush();
+        streams[j].bitCount = w[j]->bitsWritten();
+    }
+}
 
+// decodes exactly n symbols of a single stream into out
+template <int AlphabetSize, typename SymbolT>
+void HuffmanCoder<AlphabetSize, SymbolT>::decode(const unsigned char *bytes, long long size, SymbolT *out,
+                                                 long long n)
+{
+    BitReader r(bytes, size);
+    for (long long i = 0; i < n; i++)
+    {
+        r.refill();
+        out[i] = (SymbolT)this->table.decodeSymbol(r);
+    }
+}
 
-double getCompressionRatio(long long encodedShiiLength, long long origLength)
+// one refill leaves at least 56 bits, enough for two codes of
+// MAX_CODE_LEN bits, so every round decodes 8 symbols
+template <int AlphabetSize, typename SymbolT>
+void HuffmanCoder<AlphabetSize, SymbolT>::decodeFour(const unsigned char *const data[4], const long long size[4],
+                                                     SymbolT *out, long long n)
 {
-    return (1.0 - (encodedShiiLength/((double)(origLength)*8)));
+    DecodeTable &table = this->table;
+    BitReader r0(data[0], size[0]), r1(data[1], size[1]), r2(data[2], size[2]), r3(data[3], size[3]);
+    long long i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        r0.refill();
+        r1.refill();
+        r2.refill();
+        r3.refill();
+        out[i] = (SymbolT)table.decodeSymbol(r0);
+        out[i + 1] = (SymbolT)table.decodeSymbol(r1);
+        out[i + 2] = (SymbolT)table.decodeSymbol(r2);
+        out[i + 3] = (SymbolT)table.decodeSymbol(r3);
+        out[i + 4] = (SymbolT)table.decodeSymbol(r0);
+        out[i + 5] = (SymbolT)table.decodeSymbol(r1);
+        out[i + 6] = (SymbolT)table.decodeSymbol(r2);
+        out[i + 7] = (SymbolT)table.decodeSymbol(r3);
+    }
+    BitReader *r[4] = {&r0, &r1, &r2, &r3};
+    for (; i < n; i++)
+    {
+        r[i & 3]->refill();
+        out[i] = (SymbolT)table.decodeSymbol(*r[i & 3]);
+    }
 }
 
+// decodes by walking the canonical tree bit by bit until all bits
+// or maxCount symbols are used up, returns the number of symbols
+template <int AlphabetSize, typename SymbolT>
+long long HuffmanCoder<AlphabetSize, SymbolT>::walkTree(const EncodedBits &bits, SymbolT *out, long long maxCount)
+{
+    BitReader r(bits.bytes.data(), (long long)bits.bytes.size());
+    HuffArena arena;
+    FlatHuffTree tree = buildCanonicalFlatTree(this->codes.data(), AlphabetSize, arena);
+    if (tree.root < 0)
+        return 0;
+    int node = tree.root;
+    long long n = 0;
+    for (long long b = 0; b < bits.bitCount && n < maxCount; b++)
+    {
+        node = r.readBit() == 0 ? arena.left[node] : arena.right[node];
+        if (node == FLAT_NONE)
+            break;
+
+        if (arena.left[node] == FLAT_NONE && arena.right[node] == FLAT_NONE)
+        {
+            out[n++] = (SymbolT)arena.symbol[node];
+            node = tree.root;
+        }
+    }
+    return n;
+}
 
 
+EncodedBits encode(string s, HuffNode *huffmanTree)
+{
+    uint8_t lens[TEXT_ALPHABET];
+    getCodeLengths(huffmanTree, TEXT_ALPHABET, lens);
+    TextCoder coder;
+    coder.useLengths(lens);
 
+    EncodedBits res;
+    coder.encode((const unsigned char *)s.data(), (long long)s.length(), res);
+    return res;
+}
 
-int main()
+// decodes symbols until all bitCount bits are used up
+string decodeWithTable(const EncodedBits &bits, DecodeTable &table)
 {
+    string res = "";
+    res.reserve(bits.bitCount / 2);
+    BitReader r(bits.bytes.data(), (long long)bits.bytes.size());
+    while (r.position() < bits.bitCount)
+    {
+        r.refill();
+        res += (char)table.decodeSymbol(r);
+    }
+    return res;
+}
+
+string decode(const EncodedBits &bits, HuffNode *huffmanTree, DecodeStrategy strategy = DECODE_TABLE)
+{
+    string res = "";
+    if (!huffmanTree)
+        return res;
+    uint8_t lens[TEXT_ALPHABET];
+    getCodeLengths(huffmanTree, TEXT_ALPHABET, lens);
+    TextCoder coder;
+    coder.useLengths(lens);
+    if (strategy == DECODE_TABLE && coder.buildDecoder())
+        return decodeWithTable(bits, coder.table);
+
+    res.resize(bits.bitCount);
+    res.resize(coder.walkTree(bits, (unsigned char *)&res[0], bits.bitCount));
+    return res;
+}
+
+// Image compression part
+unsigned char *loadImage(string path, int &width, int &height, int &channels)
+{
+    // Loading the image
+    unsigned char *img_data = stbi_load(path.c_str(), &width, &height, &channels, 0);
+
+    if (!img_data)
+    {
+        cout << "Error loading the image" << endl;
+        return nullptr;
+    }
+    cout << "Image Loaded" << endl;
+    return img_data;
+}
+
+// 16 bit per channel images, samples in native byte order
+uint16_t *loadImage16(string path, int &width, int &height, int &channels)
+{
+    uint16_t *img_data = stbi_load_16(path.c_str(), &width, &height, &channels, 0);
+
+    if (!img_data)
+    {
+        cout << "Error loading the image" << endl;
+        return nullptr;
+    }
+    cout << "Image Loaded" << endl;
+    return img_data;
+}
+HuffNode *buildHuffmanTreeForImage(unsigned char *img_data, long long data_size, int maxCodeLen = 0)
+{
+    // Array size is 511 because after processing the
+    // pixel values, the range of them is [0, 510]
+    // Used predictive coding here
+    // As the pixel values are quite close,
+    // We subtract the left val from the current pixel val
+    // this creates a list of repeating vals on which
+    // effective huffman encoding can be applied
+    // To cater for negative vals, we add 255
+    int freqs[IMAGE_ALPHABET];
+    histogramResidualsParallel(img_data, data_size, freqs);
+    return buildHuffmanTreeFromFreqs(freqs, IMAGE_ALPHABET, maxCodeLen);
+}
+
+// Residual mappings
+// how the prediction error d = sample - predicted becomes a symbol,
+// chosen by the sample and symbol types:
+//   8 bit samples, uint16_t symbols       d + 255, IMAGE_ALPHABET symbols
+//   8 bit samples, unsigned char symbols  d modulo 256 zigzagged (0, -1,
+//                                         1, -2, 2, ...), TEXT_ALPHABET
+//                                         symbols
+//   16 bit samples, uint16_t symbols      d modulo 65536 zigzagged, coded
+//                                         as magnitude classes (see Tokens)
+// samples are rebuilt modulo 2^bits so the wrapping loses nothing
+template <typename S, typename T>
+struct ResidualMap;
+
+template <>
+struct ResidualMap<unsigned char, uint16_t>
+{
+    static uint16_t map(int d) { return (uint16_t)(d + 255); }
+    static int unmap(uint16_t r) { return r - 255; }
+    static int magnitude(int d) { return abs(d); }
+};
+
+template <>
+struct ResidualMap<unsigned char, unsigned char>
+{
+    static unsigned char map(int d)
+    {
+        int w = (int8_t)d;
+        return (unsigned char)(((unsigned)w << 1) ^ (unsigned)(w >> 7));
+    }
+    static int unmap(unsigned char r) { return (r >> 1) ^ -(r & 1); }
+    static int magnitude(int d) { return abs((int8_t)d); }
+};
+
+template <>
+struct ResidualMap<uint16_t, uint16_t>
+{
+    static uint16_t map(int d)
+    {
+        int w = (int16_t)d;
+        return (uint16_t)(((unsigned)w << 1) ^ (unsigned)(w >> 15));
+    }
+    static int unmap(uint16_t r) { return (r >> 1) ^ -(r & 1); }
+    static int magnitude(int d) { return abs((int16_t)d); }
+};
+
+// residuals of n samples, every sample is predicted from the one
+// distance samples before it (1 for the left sample, the channel count
+// for the same channel of the pixel before), the first distance
+// samples from 0
+// every residual only reads the image, there is no chain from one
+// sample to the next, so the loop compiles to vector code
+template <typename S, typename T>
+void computeResiduals(const S *img, long long n, int distance, T residuals[])
+{
+    long long head = min(n, (long long)distance);
+    for (long long i = 0; i < head; i++)
+        residuals[i] = ResidualMap<S, T>::map(img[i]);
+    for (long long i = head; i < n; i++)
+        residuals[i] = ResidualMap<S, T>::map(img[i] - img[i - distance]);
+}
+
+// Here we apply the reverse process of before
+// first the residual is unmapped
+// then the predicted val is added
+template <typename S, typename T>
+void undoResiduals(const T residuals[], long long n, int distance, S *img)
+{
+    long long head = min(n, (long long)distance);
+    for (long long i = 0; i < head; i++)
+        img[i] = (S)ResidualMap<S, T>::unmap(residuals[i]);
+    for (long long i = head; i < n; i++)
+        img[i] = (S)(ResidualMap<S, T>::unmap(residuals[i]) + img[i - distance]);
+}
+
+// Row filters
+// 2D prediction of every sample from its neighbours in the same
+// channel: a (left), b (up) and c (up left), chosen per row like
+// png filters; neighbours outside the rows being coded count as 0,
+// so a row never predicts from the end of the row before it
+// rows are rowSamples samples (width times channels) long
+enum RowFilter
+{
+    FILTER_NONE,
+    FILTER_LEFT,
+    FILTER_UP,
+    FILTER_AVERAGE,
+    FILTER_PAETH,
+    FILTER_MED,
+    FILTER_GRADIENT,
+    FILTER_COUNT
+};
+
+template <int Filter, typename S>
+inline int predictSample(int a, int b, int c)
+{
+    switch (Filter)
+    {
+    case FILTER_NONE:
+        return 0;
+    case FILTER_LEFT:
+        return a;
+    case FILTER_UP:
+        return b;
+    case FILTER_AVERAGE:
+        return (a + b) >> 1;
+    case FILTER_PAETH:
+    {
+        int p = a + b - c;
+        int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+        if (pa <= pb && pa <= pc)
+            return a;
+        return pb <= pc ? b : c;
+    }
+    case FILTER_MED:
+        // median edge detector of JPEG-LS
+        if (c >= max(a, b))
+            return min(a, b);
+        if (c <= min(a, b))
+            return max(a, b);
+        return a + b - c;
+    default:
+        return min(max(a + b - c, 0), (int)numeric_limits<S>::max());
+    }
+}
+
+// residuals of one row, up is the row above (a row of zeros for the
+// first row)
+template <int Filter, typename S, typename T>
+void filterRowWith(const S *cur, const S *up, int rowSamples, int channels, T residuals[])
+{
+    int head = min(channels, rowSamples);
+    for (int i = 0; i < head; i++)
+        residuals[i] = ResidualMap<S, T>::map(cur[i] - predictSample<Filter, S>(0, up[i], 0));
+    for (int i = head; i < rowSamples; i++)
+        residuals[i] =
+            ResidualMap<S, T>::map(cur[i] - predictSample<Filter, S>(cur[i - channels], up[i], up[i - channels]));
+}
+
+// the reverse, cur is rebuilt from the left
+template <int Filter, typename S, typename T>
+void unfilterRowWith(const T residuals[], const S *up, int rowSamples, int channels, S *cur)
+{
+    int head = min(channels, rowSamples);
+    for (int i = 0; i < head; i++)
+        cur[i] = (S)(ResidualMap<S, T>::unmap(residuals[i]) + predictSample<Filter, S>(0, up[i], 0));
+    for (int i = head; i < rowSamples; i++)
+        cur[i] = (S)(ResidualMap<S, T>::unmap(residuals[i]) +
+                     predictSample<Filter, S>(cur[i - channels], up[i], up[i - channels]));
+}
+
+// fast cost estimate: sum of the absolute residuals of the row
+template <int Filter, typename S, typename T>
+long long rowCostWith(const S *cur, const S *up, int rowSamples, int channels)
+{
+    long long cost = 0;
+    int head = min(channels, rowSamples);
+    for (int i = 0; i < head; i++)
+        cost += ResidualMap<S, T>::magnitude(cur[i] - predictSample<Filter, S>(0, up[i], 0));
+    for (int i = head; i < rowSamples; i++)
+        cost += ResidualMap<S, T>::magnitude(cur[i] -
+                                             predictSample<Filter, S>(cur[i - channels], up[i], up[i - channels]));
+    return cost;
+}
+
+// the kernels of every filter for one sample and symbol type
+template <typename S, typename T>
+struct RowFilters
+{
+    typedef void (*FilterFn)(const S *, const S *, int, int, T[]);
+    typedef void (*UnfilterFn)(const T[], const S *, int, int, S *);
+    typedef long long (*CostFn)(const S *, const S *, int, int);
+    static const FilterFn filter[FILTER_COUNT];
+    static const UnfilterFn unfilter[FILTER_COUNT];
+    static const CostFn cost[FILTER_COUNT];
+};
+
+template <typename S, typename T>
+const typename RowFilters<S, T>::FilterFn RowFilters<S, T>::filter[FILTER_COUNT] = {
+    filterRowWith<FILTER_NONE, S, T>, filterRowWith<FILTER_LEFT, S, T>, filterRowWith<FILTER_UP, S, T>,
+    filterRowWith<FILTER_AVERAGE, S, T>, filterRowWith<FILTER_PAETH, S, T>, filterRowWith<FILTER_MED, S, T>,
+    filterRowWith<FILTER_GRADIENT, S, T>};
+
+template <typename S, typename T>
+const typename RowFilters<S, T>::UnfilterFn RowFilters<S, T>::unfilter[FILTER_COUNT] = {
+    unfilterRowWith<FILTER_NONE, S, T>, unfilterRowWith<FILTER_LEFT, S, T>, unfilterRowWith<FILTER_UP, S, T>,
+    unfilterRowWith<FILTER_AVERAGE, S, T>, unfilterRowWith<FILTER_PAETH, S, T>, unfilterRowWith<FILTER_MED, S, T>,
+    unfilterRowWith<FILTER_GRADIENT, S, T>};
+
+template <typename S, typename T>
+const typename RowFilters<S, T>::CostFn RowFilters<S, T>::cost[FILTER_COUNT] = {
+    rowCostWith<FILTER_NONE, S, T>, rowCostWith<FILTER_LEFT, S, T>, rowCostWith<FILTER_UP, S, T>,
+    rowCostWith<FILTER_AVERAGE, S, T>, rowCostWith<FILTER_PAETH, S, T>, rowCostWith<FILTER_MED, S, T>,
+    rowCostWith<FILTER_GRADIENT, S, T>};
+
+// picks a filter for each of rows rows by the cost estimate, per row
+// or one for all of them (perRow false), and filters them into residuals
+// zeros holds at least rowSamples zeros
+template <typename S, typename T>
+void filterRows(const S *img, int rows, int rowSamples, int channels, bool perRow, const S *zeros,
+                unsigned char filters[], T residuals[])
+{
+    vector<long long> costs((size_t)rows * FILTER_COUNT);
+    for (int y = 0; y < rows; y++)
+    {
+        const S *up = y == 0 ? zeros : img + (long long)(y - 1) * rowSamples;
+        for (int f = 0; f < FILTER_COUNT; f++)
+            costs[(size_t)y * FILTER_COUNT + f] =
+                RowFilters<S, T>::cost[f](img + (long long)y * rowSamples, up, rowSamples, channels);
+    }
+    if (!perRow)
+    {
+        long long total[FILTER_COUNT] = {0};
+        for (int y = 0; y < rows; y++)
+            for (int f = 0; f < FILTER_COUNT; f++)
+                total[f] += costs[(size_t)y * FILTER_COUNT + f];
+        int best = (int)(min_element(total, total + FILTER_COUNT) - total);
+        for (int y = 0; y < rows; y++)
+            filters[y] = (unsigned char)best;
+    }
+    else
+    {
+        for (int y = 0; y < rows; y++)
+        {
+            const long long *c = &costs[(size_t)y * FILTER_COUNT];
+            filters[y] = (unsigned char)(min_element(c, c + FILTER_COUNT) - c);
+        }
+    }
+    for (int y = 0; y < rows; y++)
+    {
+        const S *up = y == 0 ? zeros : img + (long long)(y - 1) * rowSamples;
+        RowFilters<S, T>::filter[filters[y]](img + (long long)y * rowSamples, up, rowSamples, channels,
+                                             residuals + (long long)y * rowSamples);
+    }
+}
+
+template <typename S, typename T>
+void unfilterRows(const T residuals[], int rows, int rowSamples, int channels, const unsigned char filters[],
+                  const S *zeros, S *img)
+{
+    for (int y = 0; y < rows; y++)
+    {
+        const S *up = y == 0 ? zeros : img + (long long)(y - 1) * rowSamples;
+        RowFilters<S, T>::unfilter[filters[y]](residuals + (long long)y * rowSamples, up, rowSamples, channels,
+                                               img + (long long)y * rowSamples);
+    }
+}
+
+// Color transforms
+// reversible decorrelation of the first three channels (r, g, b) of
+// every pixel before prediction, further channels are left alone
+//   COLOR_RCT      the reversible color transform of JPEG 2000:
+//                  cb = b - g, cr = r - g, y = g + (cb + cr) >> 2
+//   COLOR_YCOCG_R  co = r - b, t = b + co >> 1, cg = g - t,
+//                  y = t + cg >> 1
+// both are lifting steps, so they stay exact when every value wraps
+// modulo 2^bits (differences are read back as signed samples), and
+// samples keep their size; chroma is stored + 2^(bits - 1) so gray
+// pixels sit in the middle and not on both sides of the wrap
+enum ColorTransform
+{
+    COLOR_NONE,
+    COLOR_RCT,
+    COLOR_YCOCG_R,
+    COLOR_AUTO
+};
+
+template <typename S>
+inline int signedSample(int v)
+{
+    return (typename make_signed<S>::type)v;
+}
+
+template <typename S>
+void forwardColor(int transform, const S *src, long long n, int channels, S *dst)
+{
+    const int half = (numeric_limits<S>::max() + 1) / 2;
+    for (long long i = 0; i + channels <= n; i += channels)
+    {
+        int r = src[i], g = src[i + 1], b = src[i + 2];
+        if (transform == COLOR_RCT)
+        {
+            int cb = signedSample<S>(b - g), cr = signedSample<S>(r - g);
+            dst[i] = (S)(g + ((cb + cr) >> 2));
+            dst[i + 1] = (S)(cb + half);
+            dst[i + 2] = (S)(cr + half);
+        }
+        else
+        {
+            int co = signedSample<S>(r - b);
+            int t = b + (co >> 1);
+            int cg = signedSample<S>(g - t);
+            dst[i] = (S)(t + (cg >> 1));
+            dst[i + 1] = (S)(co + half);
+            dst[i + 2] = (S)(cg + half);
+        }
+        for (int k = 3; k < channels; k++)
+            dst[i + k] = src[i + k];
+    }
+}
+
+// the reverse, in place
+template <typename S>
+void inverseColor(int transform, S *img, long long n, int channels)
+{
+    const int half = (numeric_limits<S>::max() + 1) / 2;
+    for (long long i = 0; i + channels <= n; i += channels)
+    {
+        int y = img[i], c1 = signedSample<S>(img[i + 1] - half), c2 = signedSample<S>(img[i + 2] - half);
+        if (transform == COLOR_RCT)
+        {
+            int g = y - ((c1 + c2) >> 2);
+            img[i] = (S)(g + c2);
+            img[i + 1] = (S)g;
+            img[i + 2] = (S)(g + c1);
+        }
+        else
+        {
+            int t = y - (c2 >> 1);
+            int b = t - (c1 >> 1);
+            img[i] = (S)(b + c1);
+            img[i + 1] = (S)(c2 + t);
+            img[i + 2] = (S)b;
+        }
+    }
+}
+
+// COLOR_AUTO picks the transform by the cost estimate of the row
+// filters over every step-th row of the image
+template <typename S>
+int chooseColor(const S *img, int rows, int rowSamples, int channels, int step = 8)
+{
+    if (channels < 3 || rows < 2)
+        return COLOR_NONE;
+    vector<S> pair(2 * (size_t)rowSamples);
+    long long best = -1;
+    int chosen = COLOR_NONE;
+    for (int transform = COLOR_NONE; transform < COLOR_AUTO; transform++)
+    {
+        long long cost = 0;
+        for (int y = 1; y < rows; y += step)
+        {
+            const S *src = img + (long long)(y - 1) * rowSamples;
+            if (transform == COLOR_NONE)
+                copy_n(src, 2 * (size_t)rowSamples, pair.begin());
+            else
+                forwardColor(transform, src, 2 * (long long)rowSamples, channels, pair.data());
+            long long rowBest = -1;
+            for (int f = 0; f < FILTER_COUNT; f++)
+            {
+                long long c = RowFilters<S, S>::cost[f](pair.data() + rowSamples, pair.data(), rowSamples, channels);
+                if (rowBest < 0 || c < rowBest)
+                    rowBest = c;
+            }
+            cost += rowBest;
+        }
+        if (best < 0 || cost < best)
+        {
+            best = cost;
+            chosen = transform;
+        }
+    }
+    return chosen;
+}
+
+// Tokens
+// residuals (up to 65535 after the zigzag) are coded as a token
+// from a small alphabet and raw extra bits: values below TOKEN_DIRECT
+// are their own token, a larger value with k significant bits is
+// token TOKEN_DIRECT + 2 (k - 5) + the bit below its top bit, followed
+// by its k - 2 lower bits; the tokens are coded like bytes
+const int TOKEN_DIRECT = 16;
+const int TOKEN_COUNT = TOKEN_DIRECT + 2 * (16 - 4);
+
+inline unsigned char tokenOf(uint32_t v)
+{
+    if (v < (uint32_t)TOKEN_DIRECT)
+        return (unsigned char)v;
+    int k = bitLength(v);
+    return (unsigned char)(TOKEN_DIRECT + 2 * (k - 5) + ((v >> (k - 2)) & 1));
+}
+
+// the extra bits of token t
+inline int extraBits(int t)
+{
+    return t < TOKEN_DIRECT ? 0 : (t - TOKEN_DIRECT) / 2 + 3;
+}
+
+inline void writeExtra(BitWriter &w, uint32_t v, int t)
+{
+    int len = extraBits(t);
+    if (len > 0)
+        w.write(v, len);
+}
+
+inline uint32_t readValue(BitReader &r, int t)
+{
+    int len = extraBits(t);
+    if (len == 0)
+        return (uint32_t)t;
+    uint32_t top = 2 | ((t - TOKEN_DIRECT) & 1);
+    return (top << len) | r.read(len);
+}
+
+// Zero runs
+// with RESIDUALS_RUNS, RUN_MIN or more zero residuals in a row are one
+// token RUN_TOKEN + the token of the run length - RUN_MIN, its extra bits
+// go with those of the values; runs longer than RUN_MAX are split
+const int RUN_MIN = 4;
+const int RUN_TOKEN = TOKEN_COUNT;
+const long long RUN_MAX = RUN_MIN + 0xFFFF;
+
+// turns n residuals into tokens and returns how many there are
+template <typename T>
+long long collapseRuns(const T values[], long long n, unsigned char tokens[], BitWriter &w)
+{
+    long long m = 0;
+    for (long long i = 0; i < n;)
+    {
+        long long j = i;
+        while (j < n && values[j] == 0 && j - i < RUN_MAX)
+            j++;
+        if (j - i >= RUN_MIN)
+        {
+            uint32_t v = (uint32_t)(j - i - RUN_MIN);
+            int t = tokenOf(v);
+            tokens[m++] = (unsigned char)(RUN_TOKEN + t);
+            writeExtra(w, v, t);
+            i = j;
+            continue;
+        }
+        if (j == i)
+            j++;
+        for (; i < j; i++)
+        {
+            int t = tokenOf(values[i]);
+            tokens[m++] = (unsigned char)t;
+            writeExtra(w, values[i], t);
+        }
+    }
+    return m;
+}
+
+// the inverse, false unless the m tokens make exactly n residuals
+template <typename T>
+bool expandRuns(const unsigned char tokens[], long long m, BitReader &r, T values[], long long n)
+{
+    long long i = 0;
+    for (long long k = 0; k < m; k++)
+    {
+        int t = tokens[k];
+        if (t >= RUN_TOKEN + TOKEN_COUNT)
+            return false;
+        if (t >= RUN_TOKEN)
+        {
+            long long len = RUN_MIN + (long long)readValue(r, t - RUN_TOKEN);
+            if (len > n - i)
+                return false;
+            fill_n(values + i, len, (T)0);
+            i += len;
+        }
+        else
+        {
+            if (i == n)
+                return false;
+            values[i++] = (T)readValue(r, t);
+        }
+    }
+    return i == n;
+}
+
+// samples k, k + planes, k + 2 planes, ... of n form plane k
+long long planeLength(long long n, int planes, int k)
+{
+    return (n - k + planes - 1) / planes;
+}
+
+// interleaved samples to planes one after the other, and back
+template <typename T>
+void gatherPlanes(const T src[], long long n, int planes, T dst[])
+{
+    for (int k = 0; k < planes; k++)
+    {
+        for (long long i = k; i < n; i += planes)
+            *dst++ = src[i];
+    }
+}
+
+template <typename T>
+void scatterPlanes(const T src[], long long n, int planes, T dst[])
+{
+    for (int k = 0; k < planes; k++)
+    {
+        for (long long i = k; i < n; i += planes)
+            dst[i] = *src++;
+    }
+}
+
+// tree and encoder over residuals computed once by computeResiduals,
+// so the image is neither loaded nor predicted a second time
+HuffNode *buildHuffmanTreeForResiduals(const uint16_t residuals[], long long n, int maxCodeLen = 0)
+{
+    int freqs[IMAGE_ALPHABET];
+    histogramSymbolsParallel<IMAGE_ALPHABET>(residuals, n, freqs);
+    return buildHuffmanTreeFromFreqs(freqs, IMAGE_ALPHABET, maxCodeLen);
+}
+
+EncodedBits encodeResiduals(const uint16_t residuals[], long long n, HuffNode *huffmanTree)
+{
+    uint8_t lens[IMAGE_ALPHABET];
+    getCodeLengths(huffmanTree, IMAGE_ALPHABET, lens);
+    ImageCoder coder;
+    coder.useLengths(lens);
+
+    EncodedBits res;
+    coder.encode(residuals, n, res);
+    return res;
+}
+
+EncodedBits encodeImage(unsigned char *img_data, long long data_size, HuffNode *huffmanTree)
+{
+    vector<uint16_t> residuals(data_size);
+    computeResiduals(img_data, data_size, 1, residuals.data());
+    return encodeResiduals(residuals.data(), data_size, huffmanTree);
+}
+
+EncodedBits encodeImage(string path)
+{
+    // Loading the image
+    int width, height, channels;
+    unsigned char *img_data = loadImage(path, width, height, channels);
+    if (!img_data)
+        return EncodedBits();
+    long long data_size = (long long)width * height * channels;
+    vector<uint16_t> residuals(data_size);
+    computeResiduals(img_data, data_size, 1, residuals.data());
+    stbi_image_free(img_data);
+
+    HuffNode *huffmanTree = buildHuffmanTreeForResiduals(residuals.data(), data_size);
+    EncodedBits res = encodeResiduals(residuals.data(), data_size, huffmanTree);
+    delete huffmanTree;
+    return res;
+}
+
+
+// Saving the image after decoding
+void saveImage(string path, unsigned char *img_data, int width, int height, int channels)
+{
+    stbi_write_png(path.c_str(), width, height, channels, img_data, width*channels);
+    cout << "Decoded image saved" << endl;
+    delete[] img_data;
+}
+
+// 16 bit png output
+// stb_image_write only writes 8 bit pngs, so the chunks are put
+// together here and only the zlib stream comes from stb
+struct CrcTable
+{
+    uint32_t t[256];
+    CrcTable()
+    {
+        for (uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            this->t[n] = c;
+        }
+    }
+};
+
+uint32_t crc32(const unsigned char *data, size_t n, uint32_t crc = 0)
+{
+    static const CrcTable table;
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++)
+        crc = table.t[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+void putBE32(vector<unsigned char> &out, uint32_t v)
+{
+    unsigned char b[4] = {(unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8),
+                          (unsigned char)v};
+    out.insert(out.end(), b, b + 4);
+}
+
+void pngChunk(vector<unsigned char> &png, const char *type, const unsigned char *data, size_t n)
+{
+    putBE32(png, (uint32_t)n);
+    size_t start = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data, data + n);
+    putBE32(png, crc32(&png[start], n + 4));
+}
+
+// img_data holds 16 bit samples in native byte order, png stores them
+// big endian, every row with filter 0
+void saveImage16(string path, unsigned char *img_data, int width, int height, int channels)
+{
+    const uint16_t *samples = (const uint16_t *)img_data;
+    long long rowSamples = (long long)width * channels;
+    vector<unsigned char> raw;
+    raw.reserve((size_t)height * (rowSamples * 2 + 1));
+    for (int y = 0; y < height; y++)
+    {
+        raw.push_back(0);
+        for (long long i = 0; i < rowSamples; i++)
+        {
+            uint16_t v = samples[y * rowSamples + i];
+            raw.push_back((unsigned char)(v >> 8));
+            raw.push_back((unsigned char)v);
+        }
+    }
+    delete[] img_data;
+    int zlen = 0;
+    unsigned char *zlib = stbi_zlib_compress(raw.data(), (int)raw.size(), &zlen, 8);
+
+    const unsigned char colorTypes[4] = {0, 4, 2, 6};
+    vector<unsigned char> ihdr;
+    putBE32(ihdr, (uint32_t)width);
+    putBE32(ihdr, (uint32_t)height);
+    unsigned char rest[5] = {16, colorTypes[channels - 1], 0, 0, 0};
+    ihdr.insert(ihdr.end(), rest, rest + 5);
+    const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    vector<unsigned char> png(signature, signature + 8);
+    pngChunk(png, "IHDR", ihdr.data(), ihdr.size());
+    pngChunk(png, "IDAT", zlib, zlen);
+    pngChunk(png, "IEND", nullptr, 0);
+    free(zlib);
+
+    ofstream out(path, ios::binary);
+    out.write((const char *)png.data(), png.size());
+    cout << "Decoded image saved" << endl;
+}
+
+// decodes data_size samples of a single stream into img_data
+void decodeImageInto(const unsigned char *bytes, long long size, ImageCoder &coder,
+                     unsigned char *img_data, long long data_size)
+{
+    vector<uint16_t> residuals(data_size);
+    coder.decode(bytes, size, residuals.data(), data_size);
+    undoResiduals(residuals.data(), data_size, 1, img_data);
+}
+
+unsigned char *decodeImageWithTable(const EncodedBits &encodeImage, ImageCoder &coder, long long data_size)
+{
+    unsigned char *img_data = new unsigned char [data_size];
+    decodeImageInto(encodeImage.bytes.data(), (long long)encodeImage.bytes.size(), coder, img_data, data_size);
+    return img_data;
+}
+
+unsigned char *decodeImage(const EncodedBits &encodeImage, HuffNode *huffmanTree, long long data_size,
+                           DecodeStrategy strategy = DECODE_TABLE)
+{
+    uint8_t lens[IMAGE_ALPHABET];
+    getCodeLengths(huffmanTree, IMAGE_ALPHABET, lens);
+    ImageCoder coder;
+    coder.useLengths(lens);
+    if (strategy == DECODE_TABLE && coder.buildDecoder())
+        return decodeImageWithTable(encodeImage, coder, data_size);
+
+    // samples past the end of the bits repeat the last one
+    vector<uint16_t> residuals(data_size, 255);
+    coder.walkTree(encodeImage, residuals.data(), data_size);
+    unsigned char *img_data = new unsigned char [data_size];
+    undoResiduals(residuals.data(), data_size, 1, img_data);
+    return img_data;
+}
+
+
+
+
+
+
+// both lengths are in bytes
+double getCompressionRatio(long long encodedBytes, long long origBytes)
+{
+    return (1.0 - (encodedBytes/(double)(origBytes)));
+}
+
+
+
+
+
+// Container format (.hach)
+// everything a separate process needs to decompress:
+//   magic "HACH", version, mode
+//   original length in bytes (samples for images), width, height,
+//   channels (0 for text)
+//   alphabet size
+// single payload modes (text/image) continue with
+//   the compactly stored code lengths
+//   payload bit count and the packed payload
+// block modes continue with a sequence of independent blocks
+//   (image blocks first store the image parameters, see ImageParams)
+//   raw length (u32, 0 ends the blocks)
+//   size of the rest of the block (u32)
+//   the block body (see Blocks)
+// followed by the block index
+//   block count (u32), then per block its file offset (u64)
+//   and symbol count (u32)
+//   index offset (u64) and "HIDX" as the last 12 bytes
+// multi byte fields are little endian
+const char HACH_MAGIC[4] = {'H', 'A', 'C', 'H'};
+const char HACH_INDEX_MAGIC[4] = {'H', 'I', 'D', 'X'};
+// image blocks changed in version 2, text is the same in both; version 3
+// added the image parameters after the predictor (color, tiles, depth,
+// residuals), zero runs and the rANS and per segment codings
+// a decoder refuses image parameters it does not know, so a parameter
+// that changes how a file decodes needs a new version
+const int HACH_VERSION = 3;
+const int HACH_HEADER_SIZE = 25;
+const int HACH_IMAGE_BLOCKS_VERSION = 2;
+
+enum HachMode
+{
+    HACH_TEXT = 0,
+    HACH_IMAGE = 1,
+    HACH_TEXT_BLOCKS = 2,
+    HACH_IMAGE_BLOCKS = 3
+};
+
+struct HachHeader
+{
+    int mode = HACH_TEXT;
+    long long origLength = 0;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    int alphabetSize = TEXT_ALPHABET;
+};
+
+// one block of the index, outOffset (where its symbols go in
+// the output) is the sum of the raw lengths before it
+struct BlockEntry
+{
+    long long offset;
+    long long rawLength;
+    long long outOffset;
+};
+
+void putLE(vector<unsigned char> &out, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        out.push_back((unsigned char)(v >> (8 * i)));
+}
+
+void putLE(ostream &out, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        out.put((char)(v >> (8 * i)));
+}
+
+// check in.fail() after reading
+uint64_t getLE(istream &in, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v |= (uint64_t)(unsigned char)in.get() << (8 * i);
+    return v;
+}
+
+uint64_t loadLE(const unsigned char *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+// code lengths go in 5 bits each, a zero length is
+// followed by 8 bits holding how many more zeros come after it
+void writeCodeLengths(vector<unsigned char> &out, const uint8_t lens[], int n)
+{
+    vector<unsigned char> bytes;
+    BitWriter w(bytes);
+    for (int i = 0; i < n; i++)
+    {
+        w.write(lens[i], 5);
+        if (lens[i] != 0)
+            continue;
+        int run = 0;
+        while (i + 1 < n && lens[i + 1] == 0 && run < 255)
+        {
+            run++;
+            i++;
+        }
+        w.write(run, 8);
+    }
+    w.flush();
+    putLE(out, bytes.size(), 2);
+    out.insert(out.end(), bytes.begin(), bytes.end());
+}
+
+bool decodeCodeLengths(const unsigned char *bytes, int size, uint8_t lens[], int n)
+{
+    BitReader r(bytes, size);
+    for (int i = 0; i < n; i++)
+    {
+        if (r.position() >= (long long)size * 8)
+            return false;
+        lens[i] = (uint8_t)r.read(5);
+        if (lens[i] != 0)
+            continue;
+        int run = (int)r.read(8);
+        if (i + run >= n)
+            return false;
+        for (int k = 0; k < run; k++)
+            lens[++i] = 0;
+    }
+    return true;
+}
+
+bool readCodeLengths(istream &in, uint8_t lens[], int n)
+{
+    int size = (int)getLE(in, 2);
+    vector<unsigned char> bytes(size);
+    in.read((char *)bytes.data(), size);
+    return !in.fail() && decodeCodeLengths(bytes.data(), size, lens, n);
+}
+
+// same from memory, pos is advanced past the lengths
+bool parseCodeLengths(const unsigned char *p, long long size, long long &pos, uint8_t lens[], int n)
+{
+    if (pos + 2 > size)
+        return false;
+    int len = (int)loadLE(p + pos, 2);
+    pos += 2;
+    if (pos + len > size)
+        return false;
+    bool ok = decodeCodeLengths(p + pos, len, lens, n);
+    pos += len;
+    return ok;
+}
+
+void writeHachHeader(ostream &out, const HachHeader &header)
+{
+    out.write(HACH_MAGIC, 4);
+    putLE(out, HACH_VERSION, 1);
+    putLE(out, header.mode, 1);
+    putLE(out, header.origLength, 8);
+    putLE(out, header.width, 4);
+    putLE(out, header.height, 4);
+    putLE(out, header.channels, 1);
+    putLE(out, header.alphabetSize, 2);
+}
+
+bool readHachHeader(istream &in, HachHeader &header)
+{
+    char magic[4];
+    in.read(magic, 4);
+    if (in.fail() || string(magic, 4) != string(HACH_MAGIC, 4))
+    {
+        cerr << "Not a hach file" << endl;
+        return false;
+    }
+    int version = (int)getLE(in, 1);
+    header.mode = (int)getLE(in, 1);
+    if (version < 1 || version > HACH_VERSION ||
+        (header.mode == HACH_IMAGE_BLOCKS && version < HACH_IMAGE_BLOCKS_VERSION))
+    {
+        cerr << "Unsupported hach version " << version << endl;
+        return false;
+    }
+    header.origLength = (long long)getLE(in, 8);
+    header.width = (int)getLE(in, 4);
+    header.height = (int)getLE(in, 4);
+    header.channels = (int)getLE(in, 1);
+    header.alphabetSize = (int)getLE(in, 2);
+    // image blocks may map residuals to either alphabet
+    bool image = header.mode == HACH_IMAGE || header.mode == HACH_IMAGE_BLOCKS;
+    bool alphabetOk = header.alphabetSize == (image ? IMAGE_ALPHABET : TEXT_ALPHABET) ||
+                      (header.mode == HACH_IMAGE_BLOCKS && header.alphabetSize == TEXT_ALPHABET);
+    if (in.fail() || header.mode > HACH_IMAGE_BLOCKS || !alphabetOk || header.origLength < 0)
+    {
+        cerr << "Corrupt hach header" << endl;
+        return false;
+    }
+    return true;
+}
+
+// single payload modes, written by older versions: code lengths and
+// payload follow the header, the decode table of the coder is rebuilt
+// from the code lengths
+template <typename Coder>
+bool readHachPayload(istream &in, Coder &coder, EncodedBits &payload)
+{
+    if (!readCodeLengths(in, coder.lens.data(), Coder::alphabetSize) || !coder.assignCodes() ||
+        !coder.buildDecoder())
+    {
+        cerr << "Corrupt code lengths" << endl;
+        return false;
+    }
+
+    payload.bitCount = (long long)getLE(in, 8);
+    if (in.fail() || payload.bitCount < 0)
+    {
+        cerr << "Corrupt hach payload" << endl;
+        return false;
+    }
+    payload.bytes.resize((payload.bitCount + 7) / 8);
+    in.read((char *)payload.bytes.data(), payload.bytes.size());
+    if (in.fail())
+    {
+        cerr << "Truncated hach payload" << endl;
+        return false;
+    }
+    return true;
+}
+
+// Image parameters
+// choices the encoder made for the whole image, stored after the
+// header of image block files as a byte count followed by the
+// parameters, so parameters can be added at the end (with a new
+// HACH_VERSION, more bytes than IMAGE_PARAMS_SIZE are refused)
+//   predictor  what every sample is predicted from:
+//              PREDICT_LEFT     the sample before it
+//              PREDICT_CHANNEL  the same channel of the pixel before it
+//              PREDICT_ROWS     a row filter per row (see Row filters),
+//                               blocks store the filter of each row
+//   color      the color transform applied before prediction (see
+//              Color transforms), older files without it use COLOR_NONE,
+//              COLOR_AUTO makes the encoder pick one for the image
+//   tileWidth  (u16) and tileHeight (u16), the blocks are tiles of this
+//   tileHeight many pixels in raster order (see Tiles); 0, also for
+//              older files, for blocks of whole rows
+//   depth      bits per sample, 8 or 16 (8 for older files); 16 bit
+//              images use RESIDUALS_CLASSES or RESIDUALS_RUNS and their
+//              lengths count samples, not bytes
+//   residuals  how residuals are mapped to symbols (see Residual
+//              mappings and Tokens), older files tell by the alphabet
+//              size in the header:
+//              RESIDUALS_OFFSET   d + 255, IMAGE_ALPHABET
+//              RESIDUALS_ZIGZAG   d modulo 2^bits zigzagged, TEXT_ALPHABET
+//              RESIDUALS_CLASSES  the zigzagged d as a magnitude class
+//                                 token and extra bits, TEXT_ALPHABET
+//              RESIDUALS_RUNS     RESIDUALS_CLASSES with runs of zeros
+//                                 as single tokens (see Zero runs)
+// tables and filters are only encoder options, each block stores what
+// it uses:
+//   TABLES_SHARED       one table for all channels
+//   TABLES_PER_CHANNEL  one table per channel
+//   TABLES_AUTO         whichever comes out smaller for the block
+//   FILTERS_PER_ROW     the cheapest filter for every row
+//   FILTERS_PER_BLOCK   the cheapest filter for all rows of the block
+// maxCodeLen is an encoder option too, the longest Huffman code of any
+// segment (code lengths are stored with every table)
+// channels, width and height come from the header
+enum ImagePredictor
+{
+    PREDICT_LEFT = 0,
+    PREDICT_CHANNEL = 1,
+    PREDICT_ROWS = 2
+};
+
+enum ImageTables
+{
+    TABLES_SHARED,
+    TABLES_PER_CHANNEL,
+    TABLES_AUTO
+};
+
+enum ImageFilters
+{
+    FILTERS_PER_ROW,
+    FILTERS_PER_BLOCK
+};
+
+enum ImageResiduals
+{
+    RESIDUALS_OFFSET,
+    RESIDUALS_ZIGZAG,
+    RESIDUALS_CLASSES,
+    RESIDUALS_RUNS
+};
+
+struct ImageParams
+{
+    int predictor = PREDICT_ROWS;
+    int tables = TABLES_AUTO;
+    int filters = FILTERS_PER_ROW;
+    int residuals = RESIDUALS_RUNS;
+    int color = COLOR_AUTO;
+    int tileWidth = 256;
+    int tileHeight = 256;
+    int depth = 8;
+    int maxCodeLen = MAX_CODE_LEN;
+    int channels = 1;
+    int width = 0;
+    int height = 0;
+};
+
+// in bytes
+const int IMAGE_PARAMS_SIZE = 8;
+
+void writeImageParams(ostream &out, const ImageParams &params)
+{
+    putLE(out, IMAGE_PARAMS_SIZE, 1);
+    putLE(out, params.predictor, 1);
+    putLE(out, params.color, 1);
+    putLE(out, params.tileWidth, 2);
+    putLE(out, params.tileHeight, 2);
+    putLE(out, params.depth, 1);
+    putLE(out, params.residuals, 1);
+}
+
+bool readImageParams(istream &in, const HachHeader &header, ImageParams &params)
+{
+    int count = (int)getLE(in, 1);
+    vector<unsigned char> bytes(count);
+    in.read((char *)bytes.data(), count);
+    params.channels = header.channels;
+    params.width = header.width;
+    params.height = header.height;
+    if (in.fail() || count < 1 || header.channels < 1 || header.width < 1)
+    {
+        cerr << "Corrupt image parameters" << endl;
+        return false;
+    }
+    if (count > IMAGE_PARAMS_SIZE)
+    {
+        cerr << "Unsupported image parameters" << endl;
+        return false;
+    }
+    params.predictor = bytes[0];
+    params.color = count > 1 ? (int)bytes[1] : (int)COLOR_NONE;
+    params.tileWidth = count > 5 ? (int)loadLE(&bytes[2], 2) : 0;
+    params.tileHeight = count > 5 ? (int)loadLE(&bytes[4], 2) : 0;
+    params.depth = count > 6 ? bytes[6] : 8;
+    if (count > 7)
+        params.residuals = bytes[7];
+    else if (params.depth == 16)
+        params.residuals = RESIDUALS_CLASSES;
+    else
+        params.residuals = header.alphabetSize == TEXT_ALPHABET ? RESIDUALS_ZIGZAG : RESIDUALS_OFFSET;
+    if (params.predictor > PREDICT_ROWS || params.color > COLOR_YCOCG_R || params.residuals > RESIDUALS_RUNS ||
+        (params.residuals == RESIDUALS_OFFSET) != (header.alphabetSize == IMAGE_ALPHABET) ||
+        (params.depth != 8 && !(params.depth == 16 && params.residuals >= RESIDUALS_CLASSES)) ||
+        (params.color != COLOR_NONE && header.channels < 3) || (params.tileWidth > 0) != (params.tileHeight > 0))
+    {
+        cerr << "Corrupt image parameters" << endl;
+        return false;
+    }
+    return true;
+}
+
+
+// Tiles
+// tile i is column i % columns and row i / columns of the grid of
+// tileWidth x tileHeight tiles, the tiles at the right and bottom edges
+// are cut to the image; a tile is coded like an image of its own size
+struct TileRect
+{
+    int x, y, width, height;
+};
+
+int tileCount(const ImageParams &params)
+{
+    return ((params.width + params.tileWidth - 1) / params.tileWidth) *
+           ((params.height + params.tileHeight - 1) / params.tileHeight);
+}
+
+TileRect tileRect(const ImageParams &params, int index)
+{
+    int columns = (params.width + params.tileWidth - 1) / params.tileWidth;
+    TileRect r;
+    r.x = index % columns * params.tileWidth;
+    r.y = index / columns * params.tileHeight;
+    r.width = min(params.tileWidth, params.width - r.x);
+    r.height = min(params.tileHeight, params.height - r.y);
+    return r;
+}
+
+// the parameters a tile is coded with
+ImageParams tileParams(const ImageParams &params, const TileRect &r)
+{
+    ImageParams tile = params;
+    tile.width = r.width;
+    tile.height = r.height;
+    return tile;
+}
+
+int pixelBytes(const ImageParams &params)
+{
+    return params.channels * params.depth / 8;
+}
+
+// the rows of a tile out of the image into a buffer, and back
+void copyTile(const unsigned char *img, const ImageParams &params, const TileRect &r, unsigned char *tile)
+{
+    int pixel = pixelBytes(params);
+    long long rowBytes = (long long)r.width * pixel;
+    for (int y = 0; y < r.height; y++)
+        memcpy(tile + y * rowBytes, img + ((long long)(r.y + y) * params.width + r.x) * pixel, rowBytes);
+}
+
+// the part of tile r inside region goes to out, which holds the
+// region (the whole image for a region of the image size)
+// pixel is the size of a pixel in bytes
+void pasteTile(const unsigned char *tile, int pixel, const TileRect &r, const TileRect &region, unsigned char *out)
+{
+    int x0 = max(r.x, region.x), x1 = min(r.x + r.width, region.x + region.width);
+    int y0 = max(r.y, region.y), y1 = min(r.y + r.height, region.y + region.height);
+    for (int y = y0; y < y1; y++)
+        memcpy(out + ((long long)(y - region.y) * region.width + (x0 - region.x)) * pixel,
+               tile + ((long long)(y - r.y) * r.width + (x0 - r.x)) * pixel, (size_t)(x1 - x0) * pixel);
+}
+
+TileRect wholeImage(const ImageParams &params)
+{
+    TileRect r = {0, 0, params.width, params.height};
+    return r;
+}
+
+// Blocks
+// text is cut into blocks of STREAM_BLOCK_SIZE bytes and images into
+// tiles or blocks of up to IMAGE_BLOCK_SIZE samples made of whole rows,
+// every block has its own histogram, tree and bitstream so blocks can
+// be encoded on separate threads and memory use does not grow with the
+// input
+// the block body starts with its coding (u8), followed by
+//   text   one segment running to the end of the body
+//   image  the number of planes (u8, 1 or one per channel), with
+//          PREDICT_ROWS the filter of every row (u8 each), then per
+//          plane the segment size (u32) and the segment, with tokens
+//          (see Tokens) followed by the size (u32) and bytes of its
+//          extra bits; with zero runs the token count (u32) of the
+//          plane comes first
+// a segment holds one table and the symbols coded with it:
+//   CODING_SINGLE        code lengths, bit count (u32), payload
+//   CODING_FOUR_STREAMS  code lengths, byte sizes of streams 0-2 (u32),
+//                        then the four streams (stream 3 runs to the end)
+//   CODING_RANS          scaled frequencies and the rANS bytes (see rANS)
+// in CODING_PER_SEGMENT blocks every segment starts with its own coding
+// (u8), CODING_FOUR_STREAMS or CODING_RANS, whichever the encoder
+// estimated smaller for its histogram
+// with more than one plane, plane k holds the residuals of channel k
+const long long STREAM_BLOCK_SIZE = 1 << 20;
+const long long IMAGE_BLOCK_SIZE = 1 << 20;
+
+enum BlockCoding
+{
+    CODING_SINGLE = 0,
+    CODING_FOUR_STREAMS = 1,
+    CODING_RANS = 2,
+    CODING_PER_SEGMENT = 3
+};
+
+// the bitstreams of a parsed block
+struct BlockPayload
+{
+    int coding;
+    const unsigned char *data[4];
+    long long size[4];
+};
+
+
+template <typename Coder>
+void decodeBlockPayload(const BlockPayload &p, Coder &coder, typename Coder::Symbol *out, long long n)
+{
+    if (p.coding == CODING_FOUR_STREAMS)
+        coder.decodeFour(p.data, p.size, out, n);
+    else if (p.coding == CODING_RANS)
+        coder.rans.decode(p.data[0], p.size[0], out, n);
+    else
+        coder.decode(p.data[0], p.size[0], out, n);
+}
+
+void patchLE(vector<unsigned char> &out, size_t pos, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        out[pos + i] = (unsigned char)(v >> (8 * i));
+}
+
+// starts a block, finishBlock fills in its size once the body is written
+size_t beginBlock(vector<unsigned char> &out, long long rawLength, int coding)
+{
+    putLE(out, rawLength, 4);
+    size_t sizePos = out.size();
+    putLE(out, 0, 4);
+    putLE(out, coding, 1);
+    return sizePos;
+}
+
+void finishBlock(vector<unsigned char> &out, size_t sizePos)
+{
+    patchLE(out, sizePos, out.size() - sizePos - 4, 4);
+}
+
+// serializes one segment made of 1 or 4 streams
+void writeSegment(vector<unsigned char> &out, const uint8_t lens[], int alphabetSize,
+                  const EncodedBits streams[], int streamCount)
+{
+    writeCodeLengths(out, lens, alphabetSize);
+    if (streamCount == 4)
+    {
+        for (int j = 0; j < 3; j++)
+            putLE(out, streams[j].bytes.size(), 4);
+    }
+    else
+        putLE(out, streams[0].bitCount, 4);
+    for (int j = 0; j < streamCount; j++)
+        out.insert(out.end(), streams[j].bytes.begin(), streams[j].bytes.end());
+}
+
+// parses a segment of size bytes, builds the decode table of
+// the coder and points the payload at the packed bits
+template <typename Coder>
+bool parseSegment(const unsigned char *p, long long size, int coding, Coder &coder, BlockPayload &payload)
+{
+    if (coding == CODING_PER_SEGMENT)
+        return size >= 1 && p[0] != CODING_PER_SEGMENT && parseSegment(p + 1, size - 1, p[0], coder, payload);
+    payload.coding = coding;
+    long long pos = 0;
+    if (coding == CODING_RANS)
+    {
+        if (!coder.rans.parseFreqs(p, size, pos) || pos + 32 > size)
+            return false;
+        for (int j = 0; j < 4; j++)
+        {
+            uint64_t x = ransState(p + pos + 8 * j);
+            if (x < RANS_LOW || x >> 63)
+                return false;
+        }
+        payload.data[0] = p + pos;
+        payload.size[0] = size - pos;
+        return true;
+    }
+    if (coding > CODING_FOUR_STREAMS || !parseCodeLengths(p, size, pos, coder.lens.data(), Coder::alphabetSize) ||
+        !coder.assignCodes() || !coder.buildDecoder())
+        return false;
+
+    if (coding == CODING_FOUR_STREAMS)
+    {
+        if (pos + 12 > size)
+            return false;
+        long long start = pos + 12;
+        for (int j = 0; j < 3; j++)
+        {
+            payload.size[j] = (long long)loadLE(p + pos + 4 * j, 4);
+            payload.data[j] = p + start;
+            start += payload.size[j];
+        }
+        if (start > size)
+            return false;
+        payload.data[3] = p + start;
+        payload.size[3] = size - start;
+        return true;
+    }
+
+    if (pos + 4 > size)
+        return false;
+    long long bitCount = (long long)loadLE(p + pos, 4);
+    pos += 4;
+    payload.size[0] = (bitCount + 7) / 8;
+    if (pos + payload.size[0] > size)
+        return false;
+    payload.data[0] = p + pos;
+    return true;
+}
+
+// parses the body of a text block (the part after its raw length and size)
+template <typename Coder>
+bool parseBlockBody(const unsigned char *body, long long size, Coder &coder, BlockPayload &payload)
+{
+    return size >= 1 && parseSegment(body + 1, size - 1, body[0], coder, payload);
+}
+
+// reads the next block into body, rawLength is 0 at the end of the blocks
+template <typename Coder>
+bool readBlock(istream &in, long long &rawLength, Coder &coder, vector<unsigned char> &body, BlockPayload &payload)
+{
+    rawLength = (long long)getLE(in, 4);
+    if (in.fail())
+    {
+        cerr << "Truncated hach stream" << endl;
+        return false;
+    }
+    if (rawLength == 0)
+        return true;
+    body.resize(getLE(in, 4));
+    in.read((char *)body.data(), body.size());
+    if (in.fail())
+    {
+        cerr << "Truncated hach block" << endl;
+        return false;
+    }
+    if (!parseBlockBody(body.data(), (long long)body.size(), coder, payload))
+    {
+        cerr << "Corrupt hach block" << endl;
+        return false;
+    }
+    return true;
+}
+
+// estimates both codings of the counted frequencies with their tables
+// and the stream headers, and leaves the rANS frequencies scaled
+template <typename Coder>
+int chooseSegmentCoding(Coder &coder, HuffArena &arena, EncodedBits scratch[4])
+{
+    const int *freqs = coder.freqs.data();
+    coder.buildCodes(arena);
+    double huffmanBits = 0;
+    for (int i = 0; i < Coder::alphabetSize; i++)
+        huffmanBits += (double)freqs[i] * coder.lens[i];
+    vector<unsigned char> &tables = scratch[0].bytes;
+    tables.clear();
+    writeCodeLengths(tables, coder.lens.data(), Coder::alphabetSize);
+    double huffmanBytes = huffmanBits / 8 + tables.size() + 12 + 2;
+
+    coder.rans.scale(freqs);
+    tables.clear();
+    coder.rans.writeFreqs(tables);
+    double ransBytes = coder.rans.costBits(freqs) / 8 + tables.size() + 32 + 2;
+    return ransBytes < huffmanBytes ? CODING_RANS : CODING_FOUR_STREAMS;
+}
+
+// codes n symbols with the frequencies in the coder into a segment
+// the coder, scratch (4 streams) and the arena are reused between calls
+template <typename Coder>
+void encodeSegment(Coder &coder, const typename Coder::Symbol *symbols, long long n, vector<unsigned char> &out,
+                   EncodedBits scratch[4], HuffArena &arena, int coding)
+{
+    if (coding == CODING_PER_SEGMENT)
+    {
+        coding = chooseSegmentCoding(coder, arena, scratch);
+        putLE(out, coding, 1);
+    }
+    else if (coding == CODING_RANS)
+        coder.rans.scale(coder.freqs.data());
+    else
+        coder.buildCodes(arena);
+    if (coding == CODING_RANS)
+    {
+        coder.rans.writeFreqs(out);
+        coder.rans.encode(symbols, n, scratch[0].bytes, out);
+        return;
+    }
+    if (coding == CODING_FOUR_STREAMS)
+    {
+        coder.encodeFour(symbols, n, scratch);
+        writeSegment(out, coder.lens.data(), Coder::alphabetSize, scratch, 4);
+        return;
+    }
+    coder.encode(symbols, n, scratch[0]);
+    writeSegment(out, coder.lens.data(), Coder::alphabetSize, scratch, 1);
+}
+
+// codes one block of symbols with its own histogram and code
+template <typename Coder>
+void encodeBlock(Coder &coder, const typename Coder::Symbol *symbols, long long n, vector<unsigned char> &out,
+                 EncodedBits scratch[4], HuffArena &arena, int coding = CODING_PER_SEGMENT)
+{
+    size_t sizePos = beginBlock(out, n, coding);
+    coder.count(symbols, n);
+    encodeSegment(coder, symbols, n, out, scratch, arena, coding);
+    finishBlock(out, sizePos);
+}
+
+// Codec contexts
+// everything one encode or decode works on: the histograms, code and
+// decode tables of both alphabets and the scratch buffers
+// contexts share nothing, so with one context per thread every call
+// is reentrant, and a context reused across calls keeps its buffers
+class HachimanEncoderContext
+{
+public:
+    TextCoder textCoder;
+    ImageCoder imageCoder;
+    HuffArena arena;
+    EncodedBits streams[4];
+    vector<uint16_t> residuals;
+    vector<uint16_t> planes;
+    vector<unsigned char> byteResiduals;
+    vector<unsigned char> bytePlanes;
+    vector<unsigned char> tokens;
+    vector<unsigned char> tokenPlanes;
+    vector<unsigned char> runTokens;
+    vector<unsigned char> extra;
+    vector<unsigned char> colors;
+    vector<unsigned char> tile;
+    vector<unsigned char> filters;
+    vector<unsigned char> zeros;
+    vector<int> channelFreqs;
+    vector<unsigned char> tableBytes;
+    string codes[IMAGE_ALPHABET];
+    void encodeTextBlock(const unsigned char *data, long long n, vector<unsigned char> &out,
+                         int coding = CODING_PER_SEGMENT);
+    void encodeImageBlock(const unsigned char *img_data, long long n, const ImageParams &params,
+                          vector<unsigned char> &out, int coding = CODING_PER_SEGMENT);
+    long long encodeImageTile(const unsigned char *img_data, const ImageParams &params, int index,
+                              vector<unsigned char> &out, int coding = CODING_PER_SEGMENT);
+    long long codedBits(const int freqs[], int alphabetSize, int maxLen);
+    template <typename Coder>
+    int choosePlanes(Coder &coder, const typename Coder::Symbol residuals[], long long n, const ImageParams &params);
+    template <typename S>
+    const S *transformColor(const S *img, long long n, const ImageParams &params);
+    template <typename S, typename T>
+    int predict(const S *img, long long n, const ImageParams &params, T residuals[]);
+    template <typename Coder>
+    void encodeImageBlockWith(Coder &coder, vector<typename Coder::Symbol> &residuals,
+                              vector<typename Coder::Symbol> &planes, const unsigned char *img_data, long long n,
+                              const ImageParams &params, vector<unsigned char> &out, int coding);
+    template <typename S, typename T>
+    void encodeTokenBlock(const S *img, long long n, const ImageParams &params, vector<T> &residuals,
+                          vector<T> &planes, vector<unsigned char> &out, int coding);
+};
+
+class HachimanDecoderContext
+{
+public:
+    TextCoder textCoder;
+    ImageCoder imageCoder;
+    vector<uint16_t> residuals;
+    vector<uint16_t> planes;
+    vector<unsigned char> byteResiduals;
+    vector<unsigned char> bytePlanes;
+    vector<unsigned char> tokens;
+    vector<unsigned char> zeros;
+    vector<unsigned char> tile;
+    vector<unsigned char> body;
+    bool decodeTextBlock(const unsigned char *body, long long size, unsigned char *out, long long n);
+    bool decodeImageBlock(const unsigned char *body, long long size, const ImageParams &params,
+                          unsigned char *out, long long n);
+    bool decodeImageTile(const unsigned char *body, long long size, const ImageParams &params, int index,
+                         long long n, const TileRect &region, unsigned char *out);
+    template <typename S, typename T>
+    void unpredict(const T residuals[], long long n, const ImageParams &params, const unsigned char filters[],
+                   S *out);
+    template <typename Coder>
+    bool decodeImageBlockWith(Coder &coder, vector<typename Coder::Symbol> &residuals,
+                              vector<typename Coder::Symbol> &planes, const unsigned char *body, long long size,
+                              const ImageParams &params, unsigned char *out, long long n);
+    template <typename S, typename T>
+    bool decodeTokenBlock(const unsigned char *body, long long size, const ImageParams &params, vector<T> &residuals,
+                          vector<T> &planes, S *out, long long n);
+};
+
+void HachimanEncoderContext::encodeTextBlock(const unsigned char *data, long long n, vector<unsigned char> &out,
+                                             int coding)
+{
+    encodeBlock(this->textCoder, data, n, out, this->streams, this->arena, coding);
+}
+
+// estimated bits of the residuals with these frequencies plus their table
+long long HachimanEncoderContext::codedBits(const int freqs[], int alphabetSize, int maxLen)
+{
+    uint8_t lens[IMAGE_ALPHABET];
+    this->arena.reset();
+    flatCodeLengths(buildFlatHuffmanTree(freqs, alphabetSize, this->arena), alphabetSize, lens,
+                    min(maxLen, MAX_CODE_LEN));
+    long long bits = 0;
+    for (int i = 0; i < alphabetSize; i++)
+        bits += (long long)freqs[i] * lens[i];
+    this->tableBytes.clear();
+    writeCodeLengths(this->tableBytes, lens, alphabetSize);
+    return bits + 8 * (long long)this->tableBytes.size();
+}
+
+// 1 for a shared table or the channel count for one table per channel,
+// counts the residuals into coder (shared) or channelFreqs
+template <typename Coder>
+int HachimanEncoderContext::choosePlanes(Coder &coder, const typename Coder::Symbol residuals[], long long n,
+                                         const ImageParams &params)
+{
+    const int alphabetSize = Coder::alphabetSize;
+    int channels = params.channels;
+    if (channels == 1 || params.tables == TABLES_SHARED)
+    {
+        coder.count(residuals, n);
+        return 1;
+    }
+    this->channelFreqs.resize((size_t)channels * alphabetSize);
+    histogramChannels<alphabetSize>(residuals, n, channels, this->channelFreqs.data());
+    int *shared = coder.freqs.data();
+    for (int v = 0; v < alphabetSize; v++)
+    {
+        shared[v] = 0;
+        for (int k = 0; k < channels; k++)
+            shared[v] += this->channelFreqs[k * alphabetSize + v];
+    }
+    if (params.tables == TABLES_PER_CHANNEL)
+        return channels;
+
+    // every extra plane also costs its segment size
+    long long perChannel = 32LL * (channels - 1);
+    for (int k = 0; k < channels; k++)
+        perChannel += this->codedBits(&this->channelFreqs[k * alphabetSize], alphabetSize, coder.maxLen);
+    return perChannel < this->codedBits(shared, alphabetSize, coder.maxLen) ? channels : 1;
+}
+
+// the first pixel and with PREDICT_ROWS the first row of a block are
+// predicted like those of the image, so blocks decode on their own
+void HachimanEncoderContext::encodeImageBlock(const unsigned char *img_data, long long n, const ImageParams &params,
+                                              vector<unsigned char> &out, int coding)
+{
+    this->textCoder.maxLen = this->imageCoder.maxLen = params.maxCodeLen;
+    if (params.depth == 16)
+        this->encodeTokenBlock((const uint16_t *)img_data, n, params, this->residuals, this->planes, out, coding);
+    else if (params.residuals >= RESIDUALS_CLASSES)
+        this->encodeTokenBlock(img_data, n, params, this->byteResiduals, this->bytePlanes, out, coding);
+    else if (params.residuals == RESIDUALS_ZIGZAG)
+        this->encodeImageBlockWith(this->textCoder, this->byteResiduals, this->bytePlanes, img_data, n, params, out,
+                                   coding);
+    else
+        this->encodeImageBlockWith(this->imageCoder, this->residuals, this->planes, img_data, n, params, out, coding);
+}
+
+// encodes tile index of the image, returns its sample count
+long long HachimanEncoderContext::encodeImageTile(const unsigned char *img_data, const ImageParams &params, int index,
+                                                  vector<unsigned char> &out, int coding)
+{
+    TileRect r = tileRect(params, index);
+    long long n = (long long)r.width * r.height * params.channels;
+    this->tile.resize(n * params.depth / 8);
+    copyTile(img_data, params, r, this->tile.data());
+    this->encodeImageBlock(this->tile.data(), n, tileParams(params, r), out, coding);
+    return n;
+}
+
+// the image in colors, or img itself without a color transform
+template <typename S>
+const S *HachimanEncoderContext::transformColor(const S *img, long long n, const ImageParams &params)
+{
+    if (params.color == COLOR_NONE)
+        return img;
+    this->colors.resize(n * sizeof(S));
+    forwardColor(params.color, img, n, params.channels, (S *)this->colors.data());
+    return (const S *)this->colors.data();
+}
+
+// residuals of the n samples of img, returns the number of rows whose
+// filters are in filters (0 without PREDICT_ROWS)
+template <typename S, typename T>
+int HachimanEncoderContext::predict(const S *img, long long n, const ImageParams &params, T residuals[])
+{
+    if (params.predictor != PREDICT_ROWS)
+    {
+        computeResiduals(img, n, params.predictor == PREDICT_CHANNEL ? params.channels : 1, residuals);
+        return 0;
+    }
+    int rowSamples = params.width * params.channels;
+    int rows = (int)(n / rowSamples);
+    this->filters.resize(rows);
+    this->zeros.assign(rowSamples * sizeof(S), 0);
+    filterRows(img, rows, rowSamples, params.channels, params.filters == FILTERS_PER_ROW,
+               (const S *)this->zeros.data(), this->filters.data(), residuals);
+    return rows;
+}
+
+template <typename Coder>
+void HachimanEncoderContext::encodeImageBlockWith(Coder &coder, vector<typename Coder::Symbol> &residuals,
+                                                  vector<typename Coder::Symbol> &planes,
+                                                  const unsigned char *img_data, long long n,
+                                                  const ImageParams &params, vector<unsigned char> &out, int coding)
+{
+    typedef typename Coder::Symbol Symbol;
+    residuals.resize(n);
+    int rows = this->predict(this->transformColor(img_data, n, params), n, params, residuals.data());
+    int planeCount = this->choosePlanes(coder, residuals.data(), n, params);
+
+    size_t sizePos = beginBlock(out, n, coding);
+    putLE(out, planeCount, 1);
+    out.insert(out.end(), this->filters.begin(), this->filters.begin() + rows);
+    const Symbol *symbols = residuals.data();
+    if (planeCount > 1)
+    {
+        planes.resize(n);
+        gatherPlanes(residuals.data(), n, planeCount, planes.data());
+        symbols = planes.data();
+    }
+    for (int k = 0; k < planeCount; k++)
+    {
+        long long count = planeLength(n, planeCount, k);
+        if (planeCount > 1)
+            copy_n(&this->channelFreqs[k * Coder::alphabetSize], Coder::alphabetSize, coder.freqs.begin());
+        size_t segmentPos = out.size();
+        putLE(out, 0, 4);
+        encodeSegment(coder, symbols, count, out, this->streams, this->arena, coding);
+        patchLE(out, segmentPos, out.size() - segmentPos - 4, 4);
+        symbols += count;
+    }
+    finishBlock(out, sizePos);
+}
+
+// residuals coded as magnitude class tokens (see Tokens), every plane
+// is followed by its extra bits
+template <typename S, typename T>
+void HachimanEncoderContext::encodeTokenBlock(const S *img, long long n, const ImageParams &params,
+                                              vector<T> &residuals, vector<T> &planes, vector<unsigned char> &out,
+                                              int coding)
+{
+    residuals.resize(n);
+    this->tokens.resize(n);
+    int rows = this->predict(this->transformColor(img, n, params), n, params, residuals.data());
+    for (long long i = 0; i < n; i++)
+        this->tokens[i] = tokenOf(residuals[i]);
+    int planeCount = this->choosePlanes(this->textCoder, this->tokens.data(), n, params);
+
+    size_t sizePos = beginBlock(out, n, coding);
+    putLE(out, planeCount, 1);
+    out.insert(out.end(), this->filters.begin(), this->filters.begin() + rows);
+    const T *values = residuals.data();
+    const unsigned char *tokens = this->tokens.data();
+    if (planeCount > 1)
+    {
+        planes.resize(n);
+        this->tokenPlanes.resize(n);
+        gatherPlanes(residuals.data(), n, planeCount, planes.data());
+        gatherPlanes(this->tokens.data(), n, planeCount, this->tokenPlanes.data());
+        values = planes.data();
+        tokens = this->tokenPlanes.data();
+    }
+    for (int k = 0; k < planeCount; k++)
+    {
+        long long count = planeLength(n, planeCount, k);
+        if (params.residuals == RESIDUALS_RUNS)
+        {
+            this->runTokens.resize(count);
+            this->extra.clear();
+            BitWriter w(this->extra);
+            long long m = collapseRuns(values, count, this->runTokens.data(), w);
+            w.flush();
+            this->textCoder.count(this->runTokens.data(), m);
+            putLE(out, m, 4);
+            size_t segmentPos = out.size();
+            putLE(out, 0, 4);
+            encodeSegment(this->textCoder, this->runTokens.data(), m, out, this->streams, this->arena, coding);
+            patchLE(out, segmentPos, out.size() - segmentPos - 4, 4);
+            putLE(out, this->extra.size(), 4);
+            out.insert(out.end(), this->extra.begin(), this->extra.end());
+            values += count;
+            tokens += count;
+            continue;
+        }
+        if (planeCount > 1)
+            copy_n(&this->channelFreqs[k * TEXT_ALPHABET], TEXT_ALPHABET, this->textCoder.freqs.begin());
+        size_t segmentPos = out.size();
+        putLE(out, 0, 4);
+        encodeSegment(this->textCoder, tokens, count, out, this->streams, this->arena, coding);
+        patchLE(out, segmentPos, out.size() - segmentPos - 4, 4);
+
+        size_t extraPos = out.size();
+        putLE(out, 0, 4);
+        BitWriter w(out);
+        for (long long i = 0; i < count; i++)
+            writeExtra(w, values[i], tokens[i]);
+        w.flush();
+        patchLE(out, extraPos, out.size() - extraPos - 4, 4);
+        values += count;
+        tokens += count;
+    }
+    finishBlock(out, sizePos);
+}
+
+// decodes a text block body (see parseBlockBody) of n bytes into out
+bool HachimanDecoderContext::decodeTextBlock(const unsigned char *body, long long size, unsigned char *out,
+                                             long long n)
+{
+    BlockPayload payload;
+    if (!parseBlockBody(body, size, this->textCoder, payload))
+        return false;
+    decodeBlockPayload(payload, this->textCoder, out, n);
+    return true;
+}
+
+bool HachimanDecoderContext::decodeImageBlock(const unsigned char *body, long long size, const ImageParams &params,
+                                              unsigned char *out, long long n)
+{
+    if (params.depth == 16)
+    {
+        uint16_t *samples = (uint16_t *)out;
+        if (!this->decodeTokenBlock(body, size, params, this->residuals, this->planes, samples, n))
+            return false;
+        if (params.color != COLOR_NONE)
+            inverseColor(params.color, samples, n, params.channels);
+        return true;
+    }
+    bool ok;
+    if (params.residuals >= RESIDUALS_CLASSES)
+        ok = this->decodeTokenBlock(body, size, params, this->byteResiduals, this->bytePlanes, out, n);
+    else if (params.residuals == RESIDUALS_ZIGZAG)
+        ok = this->decodeImageBlockWith(this->textCoder, this->byteResiduals, this->bytePlanes, body, size, params,
+                                        out, n);
+    else
+        ok = this->decodeImageBlockWith(this->imageCoder, this->residuals, this->planes, body, size, params, out, n);
+    if (ok && params.color != COLOR_NONE)
+        inverseColor(params.color, out, n, params.channels);
+    return ok;
+}
+
+// decodes tile index of n samples into its place in region (see pasteTile)
+bool HachimanDecoderContext::decodeImageTile(const unsigned char *body, long long size, const ImageParams &params,
+                                             int index, long long n, const TileRect &region, unsigned char *out)
+{
+    TileRect r = tileRect(params, index);
+    if (n != (long long)r.width * r.height * params.channels)
+        return false;
+    this->tile.resize(n * params.depth / 8);
+    if (!this->decodeImageBlock(body, size, tileParams(params, r), this->tile.data(), n))
+        return false;
+    pasteTile(this->tile.data(), pixelBytes(params), r, region, out);
+    return true;
+}
+
+// the start of an image block body up to its first plane: the coding,
+// the plane count and with PREDICT_ROWS the filters, pos is left at
+// the first plane
+bool parseImageHead(const unsigned char *body, long long size, const ImageParams &params, long long n, int &coding,
+                    int &planeCount, const unsigned char *&filters, long long &pos)
+{
+    if (size < 2)
+        return false;
+    coding = body[0];
+    planeCount = body[1];
+    if (planeCount != 1 && planeCount != params.channels)
+        return false;
+    pos = 2;
+    filters = body + pos;
+    if (params.predictor != PREDICT_ROWS)
+        return true;
+    long long rowSamples = (long long)params.width * params.channels;
+    if (rowSamples < 1 || n % rowSamples != 0 || pos + n / rowSamples > size)
+        return false;
+    int rows = (int)(n / rowSamples);
+    for (int y = 0; y < rows; y++)
+        if (filters[y] >= FILTER_COUNT)
+            return false;
+    pos += rows;
+    return true;
+}
+
+// the next u32 sized part of body at pos
+bool nextPart(const unsigned char *body, long long size, long long &pos, const unsigned char *&part,
+              long long &partSize)
+{
+    if (pos + 4 > size)
+        return false;
+    partSize = (long long)loadLE(body + pos, 4);
+    pos += 4;
+    if (partSize > size - pos)
+        return false;
+    part = body + pos;
+    pos += partSize;
+    return true;
+}
+
+// the reverse of HachimanEncoderContext::predict
+template <typename S, typename T>
+void HachimanDecoderContext::unpredict(const T residuals[], long long n, const ImageParams &params,
+                                       const unsigned char filters[], S *out)
+{
+    if (params.predictor != PREDICT_ROWS)
+    {
+        undoResiduals(residuals, n, params.predictor == PREDICT_CHANNEL ? params.channels : 1, out);
+        return;
+    }
+    int rowSamples = params.width * params.channels;
+    this->zeros.assign(rowSamples * sizeof(S), 0);
+    unfilterRows(residuals, (int)(n / rowSamples), rowSamples, params.channels, filters, (const S *)this->zeros.data(),
+                 out);
+}
+
+template <typename Coder>
+bool HachimanDecoderContext::decodeImageBlockWith(Coder &coder, vector<typename Coder::Symbol> &residuals,
+                                                  vector<typename Coder::Symbol> &planes, const unsigned char *body,
+                                                  long long size, const ImageParams &params, unsigned char *out,
+                                                  long long n)
+{
+    typedef typename Coder::Symbol Symbol;
+    int coding, planeCount;
+    const unsigned char *filters;
+    long long pos;
+    if (!parseImageHead(body, size, params, n, coding, planeCount, filters, pos))
+        return false;
+    residuals.resize(n);
+    Symbol *symbols = residuals.data();
+    if (planeCount > 1)
+    {
+        planes.resize(n);
+        symbols = planes.data();
+    }
+    for (int k = 0; k < planeCount; k++)
+    {
+        const unsigned char *segment;
+        long long segmentSize;
+        BlockPayload payload;
+        if (!nextPart(body, size, pos, segment, segmentSize) ||
+            !parseSegment(segment, segmentSize, coding, coder, payload))
+            return false;
+        long long count = planeLength(n, planeCount, k);
+        decodeBlockPayload(payload, coder, symbols, count);
+        symbols += count;
+    }
+    if (planeCount > 1)
+        scatterPlanes(planes.data(), n, planeCount, residuals.data());
+    this->unpredict(residuals.data(), n, params, filters, out);
+    return true;
+}
+
+template <typename S, typename T>
+bool HachimanDecoderContext::decodeTokenBlock(const unsigned char *body, long long size, const ImageParams &params,
+                                              vector<T> &residuals, vector<T> &planes, S *out, long long n)
+{
+    int coding, planeCount;
+    const unsigned char *filters;
+    long long pos;
+    if (!parseImageHead(body, size, params, n, coding, planeCount, filters, pos))
+        return false;
+    residuals.resize(n);
+    this->tokens.resize(n);
+    T *values = residuals.data();
+    if (planeCount > 1)
+    {
+        planes.resize(n);
+        values = planes.data();
+    }
+    for (int k = 0; k < planeCount; k++)
+    {
+        const unsigned char *segment, *extra;
+        long long segmentSize, extraSize;
+        BlockPayload payload;
+        long long count = planeLength(n, planeCount, k);
+        long long m = count;
+        if (params.residuals == RESIDUALS_RUNS)
+        {
+            if (pos + 4 > size)
+                return false;
+            m = (long long)loadLE(body + pos, 4);
+            pos += 4;
+            if (m > count)
+                return false;
+        }
+        if (!nextPart(body, size, pos, segment, segmentSize) ||
+            !parseSegment(segment, segmentSize, coding, this->textCoder, payload) ||
+            !nextPart(body, size, pos, extra, extraSize))
+            return false;
+        unsigned char *tokens = this->tokens.data();
+        decodeBlockPayload(payload, this->textCoder, tokens, m);
+        BitReader r(extra, extraSize);
+        if (params.residuals == RESIDUALS_RUNS)
+        {
+            if (!expandRuns(tokens, m, r, values, count))
+                return false;
+            values += count;
+            continue;
+        }
+        for (long long i = 0; i < count; i++)
+        {
+            if (tokens[i] >= TOKEN_COUNT)
+                return false;
+            values[i] = (T)readValue(r, tokens[i]);
+        }
+        values += count;
+    }
+    if (planeCount > 1)
+        scatterPlanes(planes.data(), n, planeCount, residuals.data());
+    this->unpredict(residuals.data(), n, params, filters, out);
+    return true;
+}
+
+// the code strings stay valid until the next call on the same context
+string *getHuffmanCodes(HuffNode *h, HachimanEncoderContext &context)
+{
+    codeStrings<TEXT_ALPHABET>(h, context.codes);
+    return context.codes;
+}
+
+string *getHuffmanCodesForImage(HuffNode *h, HachimanEncoderContext &context)
+{
+    codeStrings<IMAGE_ALPHABET>(h, context.codes);
+    return context.codes;
+}
+
+// writes encoded blocks in order and records them in the directory
+void appendBlocks(ostream &out, vector<vector<unsigned char>> &encoded, const vector<long long> &rawLengths,
+                  int count, long long &written, vector<BlockEntry> &directory)
+{
+    for (int i = 0; i < count; i++)
+    {
+        long long outOffset = directory.empty() ? 0 : directory.back().outOffset + directory.back().rawLength;
+        directory.push_back({written, rawLengths[i], outOffset});
+        out.write((const char *)encoded[i].data(), encoded[i].size());
+        written += (long long)encoded[i].size();
+    }
+}
+
+// end marker and block directory
+void writeBlockEnd(ostream &out, const vector<BlockEntry> &directory, long long written)
+{
+    putLE(out, 0, 4);
+    long long directoryOffset = written + 4;
+    putLE(out, directory.size(), 4);
+    for (const BlockEntry &e : directory)
+    {
+        putLE(out, e.offset, 8);
+        putLE(out, e.rawLength, 4);
+    }
+    putLE(out, directoryOffset, 8);
+    out.write(HACH_INDEX_MAGIC, 4);
+}
+
+// loads the block index from the end of a seekable file,
+// blocksEnd is set to the file offset of the end marker
+bool readBlockDirectory(istream &in, vector<BlockEntry> &directory, long long &blocksEnd)
+{
+    in.seekg(0, ios::end);
+    long long fileSize = (long long)in.tellg();
+    if (fileSize < HACH_HEADER_SIZE + 20)
+        return false;
+    in.seekg(fileSize - 12);
+    long long directoryOffset = (long long)getLE(in, 8);
+    char magic[4];
+    in.read(magic, 4);
+    if (in.fail() || string(magic, 4) != string(HACH_INDEX_MAGIC, 4) ||
+        directoryOffset < HACH_HEADER_SIZE + 4 || directoryOffset > fileSize - 16)
+        return false;
+
+    in.seekg(directoryOffset);
+    long long count = (long long)getLE(in, 4);
+    if (in.fail() || directoryOffset + 4 + count * 12 + 12 != fileSize)
+        return false;
+    directory.resize(count);
+    long long outOffset = 0;
+    long long prev = HACH_HEADER_SIZE;
+    blocksEnd = directoryOffset - 4;
+    for (long long i = 0; i < count; i++)
+    {
+        directory[i].offset = (long long)getLE(in, 8);
+        directory[i].rawLength = (long long)getLE(in, 4);
+        directory[i].outOffset = outOffset;
+        outOffset += directory[i].rawLength;
+        if (directory[i].offset < prev || directory[i].offset + 8 > blocksEnd)
+            return false;
+        prev = directory[i].offset + 8;
+    }
+    return !in.fail();
+}
+
+// file bytes of blocks [first, last) and the block after them
+long long blockRangeEnd(const vector<BlockEntry> &directory, int last, long long blocksEnd)
+{
+    return last < (int)directory.size() ? directory[last].offset : blocksEnd;
+}
+
+// reads blocks [first, last) into data, which then starts at file
+// offset directory[first].offset
+bool readBlockRange(istream &in, const vector<BlockEntry> &directory, int first, int last, long long blocksEnd,
+                    vector<unsigned char> &data)
+{
+    long long start = directory[first].offset;
+    data.resize(blockRangeEnd(directory, last, blocksEnd) - start);
+    in.seekg(start);
+    in.read((char *)data.data(), data.size());
+    if (in.fail())
+    {
+        cerr << "Truncated hach block" << endl;
+        return false;
+    }
+    return true;
+}
+
+// Parallel block decoding
+// decodes blocks [first, last) of the index on the pool, each straight
+// into its own slice of out (out holds the output of block first onwards)
+// data holds the file bytes starting at file offset dataOffset
+// contexts holds one decoder context per worker of the pool
+// image is nullptr for text blocks, tiles go to their place in out,
+// which holds region (nullptr for the whole image) instead
+bool decodeBlocks(const unsigned char *data, long long dataOffset, long long dataSize,
+                  const vector<BlockEntry> &directory, int first, int last, const ImageParams *image,
+                  unsigned char *out, vector<HachimanDecoderContext> &contexts, WorkerPool &pool,
+                  const TileRect *region = nullptr)
+{
+    TileRect whole = image ? wholeImage(*image) : TileRect();
+    if (!region)
+        region = &whole;
+    atomic<bool> ok(true);
+    pool.run(last - first, [&](int t) {
+        const BlockEntry &e = directory[first + t];
+        long long pos = e.offset - dataOffset;
+        if (pos < 0 || pos + 8 > dataSize)
+        {
+            ok = false;
+            return;
+        }
+        const unsigned char *p = data + pos;
+        long long rawLength = (long long)loadLE(p, 4);
+        long long bodySize = (long long)loadLE(p + 4, 4);
+        unsigned char *dst = out + (e.outOffset - directory[first].outOffset) * (image ? image->depth / 8 : 1);
+        HachimanDecoderContext &context = contexts[WorkerPool::currentWorker()];
+        if (rawLength != e.rawLength || pos + 8 + bodySize > dataSize)
+            ok = false;
+        else if (!image ? !context.decodeTextBlock(p + 8, bodySize, dst, rawLength)
+                 : image->tileWidth > 0 ? !context.decodeImageTile(p + 8, bodySize, *image, first + t, rawLength,
+                                                                   *region, out)
+                                        : !context.decodeImageBlock(p + 8, bodySize, *image, dst, rawLength))
+            ok = false;
+    });
+    if (!ok)
+        cerr << "Corrupt hach block" << endl;
+    return ok;
+}
+
+
+// Streaming text compression
+// batches of blocks are read, encoded on the pool and written out
+// in order, so only one batch is ever held in memory
+// returns the number of input bytes, or -1 on a write error
+long long compressTextStream(istream &in, ostream &out, WorkerPool &pool, long long blockSize = STREAM_BLOCK_SIZE,
+                             int coding = CODING_PER_SEGMENT, int maxCodeLen = MAX_CODE_LEN)
+{
+    HachHeader header;
+    header.mode = HACH_TEXT_BLOCKS;
+    header.alphabetSize = TEXT_ALPHABET;
+    writeHachHeader(out, header);
+    long long written = HACH_HEADER_SIZE;
+
+    int batch = pool.size() * 2;
+    vector<vector<unsigned char>> raw(batch);
+    vector<vector<unsigned char>> encoded(batch);
+    vector<HachimanEncoderContext> contexts(pool.size());
+    for (HachimanEncoderContext &context : contexts)
+        context.textCoder.maxLen = maxCodeLen;
+    vector<long long> rawLengths(batch);
+    vector<BlockEntry> directory;
+    long long total = 0;
+    while (true)
+    {
+        int count = 0;
+        while (count < batch && in)
+        {
+            raw[count].resize(blockSize);
+            in.read((char *)raw[count].data(), blockSize);
+            rawLengths[count] = (long long)in.gcount();
+            if (rawLengths[count] == 0)
+                break;
+            total += rawLengths[count];
+            count++;
+        }
+        pool.run(count, [&](int i) {
+            encoded[i].clear();
+            contexts[WorkerPool::currentWorker()].encodeTextBlock(raw[i].data(), rawLengths[i], encoded[i], coding);
+        });
+        appendBlocks(out, encoded, rawLengths, count, written, directory);
+        if (count < batch)
+            break;
+    }
+    writeBlockEnd(out, directory, written);
+    out.flush();
+    return out ? total : -1;
+}
+
+// decodes the blocks that follow a HACH_TEXT_BLOCKS header one
+// after the other, for input that can not seek to the index
+bool decompressTextStream(istream &in, ostream &out)
+{
+    vector<unsigned char> block;
+    HachimanDecoderContext context;
+    while (true)
+    {
+        long long n;
+        BlockPayload payload;
+        if (!readBlock(in, n, context.textCoder, context.body, payload))
+            return false;
+        if (n == 0)
+            return (bool)out;
+        block.resize(n);
+        decodeBlockPayload(payload, context.textCoder, block.data(), n);
+        out.write((const char *)block.data(), n);
+    }
+}
+
+// decodes batches of blocks found through the index in parallel,
+// only one batch of input and output is held in memory
+bool decompressTextIndexed(istream &in, ostream &out, const vector<BlockEntry> &directory, long long blocksEnd,
+                           WorkerPool &pool)
+{
+    int count = (int)directory.size();
+    int batch = pool.size() * 4;
+    vector<unsigned char> data;
+    vector<unsigned char> block;
+    vector<HachimanDecoderContext> contexts(pool.size());
+    for (int first = 0; first < count; first += batch)
+    {
+        int last = min(count, first + batch);
+        if (!readBlockRange(in, directory, first, last, blocksEnd, data))
+            return false;
+        block.resize(directory[last - 1].outOffset + directory[last - 1].rawLength - directory[first].outOffset);
+        if (!decodeBlocks(data.data(), directory[first].offset, (long long)data.size(), directory, first, last,
+                          nullptr, block.data(), contexts, pool))
+            return false;
+        out.write((const char *)block.data(), block.size());
+    }
+    return (bool)out;
+}
+
+// "-" stands for stdin / stdout
+bool compressText(string inPath, string outPath, int maxCodeLen = MAX_CODE_LEN)
+{
+    ifstream inFile;
+    ofstream outFile;
+    if (inPath != "-")
+    {
+        inFile.open(inPath, ios::binary);
+        if (!inFile)
+        {
+            cerr << "Error opening " << inPath << endl;
+            return false;
+        }
+    }
+    if (outPath != "-")
+        outFile.open(outPath, ios::binary);
+    istream &in = inPath == "-" ? cin : inFile;
+    ostream &out = outPath == "-" ? cout : outFile;
+
+    long long total = compressTextStream(in, out, defaultPool(), STREAM_BLOCK_SIZE, CODING_PER_SEGMENT, maxCodeLen);
+    if (total < 0)
+    {
+        cerr << "Error writing " << outPath << endl;
+        return false;
+    }
+    if (outPath != "-" && total > 0)
+        cout << "Compression %age: " << getCompressionRatio(outFile.tellp(), total)*100.0 << "%" << endl;
+    return true;
+}
+
+bool decompressText(string inPath, string outPath)
+{
+    ifstream inFile;
+    ofstream outFile;
+    if (inPath != "-")
+        inFile.open(inPath, ios::binary);
+    if (outPath != "-")
+        outFile.open(outPath, ios::binary);
+    istream &in = inPath == "-" ? cin : inFile;
+    ostream &out = outPath == "-" ? cout : outFile;
+
+    HachHeader header;
+    if (!in || !readHachHeader(in, header))
+        return false;
+    if (header.mode == HACH_TEXT_BLOCKS)
+    {
+        vector<BlockEntry> directory;
+        long long blocksEnd;
+        // stdin can not seek, its blocks are read in order
+        if (inPath == "-")
+            return decompressTextStream(in, out);
+        if (readBlockDirectory(in, directory, blocksEnd))
+            return decompressTextIndexed(in, out, directory, blocksEnd, defaultPool());
+        in.clear();
+        in.seekg(HACH_HEADER_SIZE);
+        return decompressTextStream(in, out);
+    }
+    if (header.mode != HACH_TEXT)
+    {
+        cerr << inPath << " does not hold text" << endl;
+        return false;
+    }
+
+    TextCoder coder;
+    EncodedBits payload;
+    if (!readHachPayload(in, coder, payload))
+        return false;
+    string s(header.origLength, '\0');
+    coder.decode(payload.bytes.data(), (long long)payload.bytes.size(), (unsigned char *)&s[0], header.origLength);
+    out.write(s.data(), s.length());
+    return (bool)out;
+}
+
+// the image is split into tiles (or blocks of whole rows) that are
+// encoded on the pool
+bool compressImage(string imgPath, string outPath, ImageParams params = ImageParams())
+{
+    int width, height, channels;
+    bool wide = stbi_is_16_bit(imgPath.c_str());
+    unsigned char *img_data = wide ? (unsigned char *)loadImage16(imgPath, width, height, channels)
+                                   : loadImage(imgPath, width, height, channels);
+    if (!img_data)
+        return false;
+    params.depth = wide ? 16 : 8;
+    if (wide && params.residuals < RESIDUALS_CLASSES)
+        params.residuals = RESIDUALS_CLASSES;
+
+    HachHeader header;
+    header.mode = HACH_IMAGE_BLOCKS;
+    header.width = width;
+    header.height = height;
+    header.channels = channels;
+    header.origLength = (long long)width * height * channels;
+    header.alphabetSize = params.residuals == RESIDUALS_OFFSET ? IMAGE_ALPHABET : TEXT_ALPHABET;
+    params.channels = channels;
+    params.width = width;
+    if (params.color == COLOR_AUTO)
+        params.color = wide ? chooseColor((const uint16_t *)img_data, height, width * channels, channels)
+                            : chooseColor(img_data, height, width * channels, channels);
+    if (channels < 3)
+        params.color = COLOR_NONE;
+    params.height = height;
+    // the tile size is stored in 16 bits
+    params.tileWidth = min(params.tileWidth, 0xFFFF);
+    params.tileHeight = min(params.tileHeight, 0xFFFF);
+    if (params.tileWidth <= 0 || params.tileHeight <= 0)
+        params.tileWidth = params.tileHeight = 0;
+
+    long long rowBytes = (long long)width * channels;
+    long long blockSize = max(IMAGE_BLOCK_SIZE / rowBytes, 1LL) * rowBytes;
+    int blocks = params.tileWidth > 0 ? tileCount(params) : (int)((header.origLength + blockSize - 1) / blockSize);
+    vector<vector<unsigned char>> encoded(blocks);
+    vector<long long> rawLengths(blocks);
+    vector<HachimanEncoderContext> contexts(defaultPool().size());
+    defaultPool().run(blocks, [&](int i) {
+        HachimanEncoderContext &context = contexts[WorkerPool::currentWorker()];
+        if (params.tileWidth > 0)
+        {
+            rawLengths[i] = context.encodeImageTile(img_data, params, i, encoded[i]);
+            return;
+        }
+        long long start = i * blockSize;
+        rawLengths[i] = min(blockSize, header.origLength - start);
+        context.encodeImageBlock(img_data + start * (params.depth / 8), rawLengths[i], params, encoded[i]);
+    });
+    stbi_image_free(img_data);
+
+    ofstream out(outPath, ios::binary);
+    writeHachHeader(out, header);
+    writeImageParams(out, params);
+    long long written = (long long)out.tellp();
+    vector<BlockEntry> directory;
+    appendBlocks(out, encoded, rawLengths, blocks, written, directory);
+    writeBlockEnd(out, directory, written);
+    if (!out)
+    {
+        cerr << "Error writing " << outPath << endl;
+        return false;
+    }
+    cout << "Compression %age: " << getCompressionRatio(out.tellp(), header.origLength * params.depth / 8)*100.0
+         << "%" << endl;
+    return true;
+}
+
+bool holdsImage(const HachHeader &header)
+{
+    return (header.mode == HACH_IMAGE || header.mode == HACH_IMAGE_BLOCKS) &&
+           header.origLength == (long long)header.width * header.height * header.channels;
+}
+
+// reads the image parameters and the block index of an image block
+// file and checks that the blocks cover the image
+bool readImageIndex(istream &in, const HachHeader &header, ImageParams &params, vector<BlockEntry> &directory,
+                    long long &blocksEnd)
+{
+    if (!readImageParams(in, header, params))
+        return false;
+    if (!readBlockDirectory(in, directory, blocksEnd) || directory.empty() ||
+        directory.back().outOffset + directory.back().rawLength != header.origLength)
+    {
+        cerr << "Corrupt block index" << endl;
+        return false;
+    }
+    // blocks hold whole pixels, and whole rows with row filters,
+    // tiles are checked against their size when they are decoded
+    long long unit = header.channels;
+    if (params.predictor == PREDICT_ROWS)
+        unit *= header.width;
+    if (params.tileWidth > 0 && (int)directory.size() != tileCount(params))
+    {
+        cerr << "Corrupt block index" << endl;
+        return false;
+    }
+    for (const BlockEntry &e : directory)
+    {
+        if (params.tileWidth == 0 && e.outOffset % unit != 0)
+        {
+            cerr << "Corrupt block index" << endl;
+            return false;
+        }
+    }
+    in.clear();
+    return true;
+}
+
+bool decompressImage(string inPath, string pngPath)
+{
+    ifstream in(inPath, ios::binary);
+    HachHeader header;
+    if (!in || !readHachHeader(in, header))
+        return false;
+    if (!holdsImage(header))
+    {
+        cerr << inPath << " does not hold an image" << endl;
+        return false;
+    }
+
+    ImageCoder coder;
+    EncodedBits payload;
+    unsigned char *img_data;
+    if (header.mode == HACH_IMAGE)
+    {
+        if (!readHachPayload(in, coder, payload))
+            return false;
+        img_data = decodeImageWithTable(payload, coder, header.origLength);
+    }
+    else
+    {
+        // all blocks are decoded in parallel straight into the image
+        ImageParams params;
+        vector<BlockEntry> directory;
+        long long blocksEnd;
+        vector<unsigned char> data;
+        if (!readImageIndex(in, header, params, directory, blocksEnd) ||
+            !readBlockRange(in, directory, 0, (int)directory.size(), blocksEnd, data))
+            return false;
+        img_data = new unsigned char [header.origLength * params.depth / 8];
+        vector<HachimanDecoderContext> contexts(defaultPool().size());
+        if (!decodeBlocks(data.data(), directory[0].offset, (long long)data.size(), directory, 0,
+                          (int)directory.size(), &params, img_data, contexts, defaultPool()))
+        {
+            delete[] img_data;
+            return false;
+        }
+        if (params.depth == 16)
+        {
+            saveImage16(pngPath, img_data, header.width, header.height, header.channels);
+            return true;
+        }
+    }
+    saveImage(pngPath, img_data, header.width, header.height, header.channels);
+    return true;
+}
+
+// Region decoding
+// decodes the rectangle of width x height pixels at x, y of the image
+// in inPath into out (width * height * channels samples, channels as in
+// the header and 16 bit samples for a depth of 16), reading and decoding only the tiles or blocks of rows
+// that intersect it; single payload images are decoded whole
+// the region must be a non empty part of the image
+bool regionInside(const HachHeader &header, int x, int y, int width, int height)
+{
+    if (x < 0 || y < 0 || width < 1 || height < 1 || x > header.width - width || y > header.height - height)
+    {
+        cerr << "Region outside the image" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool decodeImageRegion(string inPath, int x, int y, int width, int height, unsigned char *out)
+{
+    ifstream in(inPath, ios::binary);
+    HachHeader header;
+    if (!in || !readHachHeader(in, header))
+        return false;
+    if (!holdsImage(header))
+    {
+        cerr << inPath << " does not hold an image" << endl;
+        return false;
+    }
+    if (!regionInside(header, x, y, width, height))
+        return false;
+    TileRect region = {x, y, width, height};
+    int channels = header.channels;
+
+    if (header.mode == HACH_IMAGE)
+    {
+        ImageCoder coder;
+        EncodedBits payload;
+        if (!readHachPayload(in, coder, payload))
+            return false;
+        unsigned char *img_data = decodeImageWithTable(payload, coder, header.origLength);
+        TileRect whole = {0, 0, header.width, header.height};
+        pasteTile(img_data, channels, whole, region, out);
+        delete[] img_data;
+        return true;
+    }
+
+    ImageParams params;
+    vector<BlockEntry> directory;
+    long long blocksEnd;
+    if (!readImageIndex(in, header, params, directory, blocksEnd))
+        return false;
+    vector<unsigned char> data;
+    vector<HachimanDecoderContext> contexts(defaultPool().size());
+    if (params.tileWidth > 0)
+    {
+        // the tiles of one tile row across the region are adjacent blocks
+        int columns = (params.width + params.tileWidth - 1) / params.tileWidth;
+        int c0 = x / params.tileWidth, c1 = (x + width - 1) / params.tileWidth;
+        for (int row = y / params.tileHeight; row <= (y + height - 1) / params.tileHeight; row++)
+        {
+            int first = row * columns + c0, last = row * columns + c1 + 1;
+            if (!readBlockRange(in, directory, first, last, blocksEnd, data) ||
+                !decodeBlocks(data.data(), directory[first].offset, (long long)data.size(), directory, first, last,
+                              &params, out, contexts, defaultPool(), &region))
+                return false;
+        }
+        return true;
+    }
+
+    // blocks of rows: the run of blocks holding rows y to y + height - 1
+    long long rowBytes = (long long)header.width * channels;
+    long long begin = y * rowBytes, end = (y + height) * rowBytes;
+    int first = 0, last = (int)directory.size();
+    while (directory[first].outOffset + directory[first].rawLength <= begin)
+        first++;
+    while (directory[last - 1].outOffset >= end)
+        last--;
+    int sampleBytes = params.depth / 8;
+    vector<unsigned char> rows((directory[last - 1].outOffset + directory[last - 1].rawLength -
+                                directory[first].outOffset) * sampleBytes);
+    if (!readBlockRange(in, directory, first, last, blocksEnd, data) ||
+        !decodeBlocks(data.data(), directory[first].offset, (long long)data.size(), directory, first, last, &params,
+                      rows.data(), contexts, defaultPool()))
+        return false;
+    for (int r = 0; r < height; r++)
+        memcpy(out + (long long)r * width * channels * sampleBytes,
+               rows.data() + (begin + r * rowBytes + (long long)x * channels - directory[first].outOffset) * sampleBytes,
+               (size_t)width * channels * sampleBytes);
+    return true;
+}
+
+// decodes a region of the image in inPath to a png of that size
+bool decompressImageRegion(string inPath, string pngPath, int x, int y, int width, int height)
+{
+    ifstream in(inPath, ios::binary);
+    HachHeader header;
+    ImageParams params;
+    if (!in || !readHachHeader(in, header) ||
+        (header.mode == HACH_IMAGE_BLOCKS && !readImageParams(in, header, params)))
+        return false;
+    in.close();
+    if (!holdsImage(header))
+    {
+        cerr << inPath << " does not hold an image" << endl;
+        return false;
+    }
+    // checked before the buffer is sized from the region
+    if (!regionInside(header, x, y, width, height))
+        return false;
+    unsigned char *img_data = new unsigned char [(long long)width * height * header.channels * params.depth / 8];
+    if (!decodeImageRegion(inPath, x, y, width, height, img_data))
+    {
+        delete[] img_data;
+        return false;
+    }
+    if (params.depth == 16)
+        saveImage16(pngPath, img_data, width, height, header.channels);
+    else
+        saveImage(pngPath, img_data, width, height, header.channels);
+    return true;
+}
+
+
+// usage:
+//   HachimanEncoder                       interactive demo
+//   HachimanEncoder -c  <in> <out.hach> [maxlen]
+//                                         compress a file as text (streamed in blocks)
+//   HachimanEncoder -d  <in.hach> <out>   decompress text
+//   (text modes take "-" for stdin / stdout)
+//   HachimanEncoder -ci <img> <out.hach> [maxlen]
+//                                         compress an image
+//   (maxlen limits the Huffman codes to 1-24 bits, 24 by default)
+//   HachimanEncoder -di <in.hach> <png>   decompress an image to png
+//   HachimanEncoder -ri <in.hach> <png> <x> <y> <w> <h>
+//                                         decompress the w x h region at x, y
+int main(int argc, char **argv)
+{
+    if (argc == 4 || (argc == 5 && (string(argv[1]) == "-c" || string(argv[1]) == "-ci")))
+    {
+        ios::sync_with_stdio(false);
+        string mode = argv[1];
+        int maxCodeLen = argc == 5 ? atoi(argv[4]) : MAX_CODE_LEN;
+        if (maxCodeLen < 1 || maxCodeLen > MAX_CODE_LEN)
+        {
+            cerr << "The code length limit must be 1 to " << MAX_CODE_LEN << endl;
+            return 1;
+        }
+        ImageParams params;
+        params.maxCodeLen = maxCodeLen;
+        bool ok;
+        if (mode == "-c")
+            ok = compressText(argv[2], argv[3], maxCodeLen);
+        else if (mode == "-d")
+            ok = decompressText(argv[2], argv[3]);
+        else if (mode == "-ci")
+            ok = compressImage(argv[2], argv[3], params);
+        else if (mode == "-di")
+            ok = decompressImage(argv[2], argv[3]);
+        else
+        {
+            cerr << "Unknown mode " << mode << endl;
+            ok = false;
+        }
+        return ok ? 0 : 1;
+    }
+    if (argc == 8 && string(argv[1]) == "-ri")
+    {
+        ios::sync_with_stdio(false);
+        return decompressImageRegion(argv[2], argv[3], atoi(argv[4]), atoi(argv[5]), atoi(argv[6]), atoi(argv[7]))
+                   ? 0
+                   : 1;
+    }
+
     cout << "Enter text: ";
     string s;
     getline(cin, s);
 
     cout << "Normal: " << s << endl;
     HuffNode *huffmanTree = buildHuffmanTree(s);
-    string *codes = getHuffmanCodes(huffmanTree);
+    HachimanEncoderContext context;
+    string *codes = getHuffmanCodes(huffmanTree, context);
     drawTable(s, codes);
-    string encodedShii = encode(s, huffmanTree);
-    cout << "Encoded: " << encodedShii << endl;
+    EncodedBits encodedShii = encode(s, huffmanTree);
+    cout << "Encoded: " << toBitString(encodedShii) << endl;
     cout << "Decoded: " << decode(encodedShii, huffmanTree) << endl;
-    cout << "Compression %age: " << getCompressionRatio(encodedShii.length(), s.length())*100.0 << "%" << endl;
+    cout << "Compression %age: " << getCompressionRatio(encodedShii.bytes.size(), s.length())*100.0 << "%" << endl;
+    delete huffmanTree;
 
     // string path = "3d-tech.jpg";
     // int width, height, channels;
     // unsigned char *img_data = loadImage(path, width, height, channels);
-    // long long data_size = width * height * channels;
-    // HuffNode *huffmanTree = buildHuffmanTreeForImage(img_data, data_size);
-    // string encodedShii = encodeImage(path);
+    // long long data_size = (long long)width * height * channels;
+    // vector<uint16_t> residuals(data_size);
+    // computeResiduals(img_data, data_size, 1, residuals.data());
+    // HuffNode *huffmanTree = buildHuffmanTreeForResiduals(residuals.data(), data_size);
+    // EncodedBits encodedShii = encodeResiduals(residuals.data(), data_size, huffmanTree);
     // saveImage("dec_img.png", decodeImage(encodedShii, huffmanTree, data_size), width, height, channels);
-    // cout << "Compression %age: " << getCompressionRatio(encodedShii.length(), data_size)*100.0 << "%" << endl;
-    // delete[] img_data;
+    // cout << "Compression %age: " << getCompressionRatio(encodedShii.bytes.size(), data_size)*100.0 << "%" << endl;
+    // stbi_image_free(img_data);
     // delete huffmanTree;
 
     return 0;